@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Compares fmap_find() on images whose size isn't a power of two against the
+ * byte-by-byte linear search it used before.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Included to get at is_valid_fmap() */
+#include "third-party/fmap.c"
+
+#define RUNS 5
+
+/* The search fmap_find() used for images of such size before */
+static long int bytewise_lsearch(const uint8_t *image, size_t len)
+{
+	unsigned long int offset;
+	int fmap_found = 0;
+
+	for (offset = 0; offset < len - strlen(FMAP_SIGNATURE); offset++) {
+		if (is_valid_fmap((const struct fmap *)&image[offset])) {
+			fmap_found = 1;
+			break;
+		}
+	}
+
+	if (!fmap_found)
+		return -1;
+
+	if (offset + fmap_size((const struct fmap *)&image[offset]) > len)
+		return -1;
+
+	return offset;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+/* Image with random code-like data, erased areas, strings that look like FMAP
+ * signature and a valid FMAP close to its end */
+static uint8_t *make_image(size_t size, size_t fmap_offset)
+{
+	size_t i;
+	uint32_t x = 2463534242u;
+	uint8_t *image = malloc(size);
+	struct fmap fmap = {
+		.signature = FMAP_SIGNATURE,
+		.ver_major = FMAP_VER_MAJOR,
+		.ver_minor = FMAP_VER_MINOR,
+		.size = htole32(size),
+		.name = "BENCH",
+		.nareas = 0,
+	};
+
+	for (i = 0; i < size; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		/* Every other 64 KiB block is erased */
+		image[i] = ((i >> 16) & 1) ? 0xff : (uint8_t)x;
+	}
+
+	for (i = 0x1000; i + 8 < fmap_offset; i += 0x40000)
+		memcpy(image + i, FMAP_SIGNATURE, 8);
+
+	memcpy(image + fmap_offset, &fmap, sizeof(fmap));
+	return image;
+}
+
+static double measure(long int (*search)(const uint8_t *, size_t),
+		      const uint8_t *image, size_t size, long int *result)
+{
+	int i;
+	double best = 0;
+
+	for (i = 0; i < RUNS; ++i) {
+		const double start = now_ms();
+		*result = search(image, size);
+		const double elapsed = now_ms() - start;
+
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	return best;
+}
+
+static long int fast_lsearch(const uint8_t *image, size_t size)
+{
+	return fmap_find(image, size);
+}
+
+int main(void)
+{
+	static const size_t sizes[] = {
+		(4 << 20) + (64 << 10),
+		(16 << 20) + (64 << 10),
+		(32 << 20) - (4 << 10),
+	};
+	size_t i;
+	int status = EXIT_SUCCESS;
+
+	printf("%12s %12s %12s %10s\n",
+	       "image size", "bytewise ms", "memscan ms", "speedup");
+
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		const size_t size = sizes[i];
+		uint8_t *image = make_image(size, size - 0x10000);
+		long int old_offset;
+		long int new_offset;
+
+		const double old_ms = measure(bytewise_lsearch, image, size,
+					      &old_offset);
+		const double new_ms = measure(fast_lsearch, image, size,
+					      &new_offset);
+
+		printf("%12zu %12.2f %12.2f %9.1fx\n",
+		       size, old_ms, new_ms, old_ms/new_ms);
+
+		if (old_offset != new_offset) {
+			fprintf(stderr, "Results differ: %ld vs. %ld\n",
+				old_offset, new_offset);
+			status = EXIT_FAILURE;
+		}
+
+		free(image);
+	}
+
+	return status;
+}
@@ -2,6 +2,7 @@
 
 #include "boot_data.h"
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,201 +10,251 @@
 
 #include "utils.h"
 
-static void boot_data_add_device(struct boot_record *record, const char *device)
-{
-	char **new_device = GROW_ARRAY(record->devices, record->device_count);
-	if (new_device == NULL)
-		return;
+#include "third-party/common.h"
 
-	*new_device = strdup(device);
-	if (*new_device == NULL)
-		return;
+static void boot_data_add_device(struct boot_data *boot,
+				 struct boot_record *record,
+				 struct str_view device)
+{
+	/* Devices of a record are consecutive lines, so they form a slice of
+	 * the shared array */
+	if (record->device_count == 0)
+		record->devices = &boot->devices[boot->device_count];
 
+	boot->devices[boot->device_count++] = device;
 	++record->device_count;
 }
 
-static void boot_data_add_record(struct boot_data *boot, const char *name)
+static void boot_data_add_record(struct boot_data *boot, struct str_view name)
 {
-	struct boot_record *new_record = GROW_ARRAY(boot->records,
-						    boot->record_count);
-	if (new_record == NULL)
-		return;
-
-	new_record->name = strdup(name);
-	if (new_record->name == NULL)
-		return;
+	struct boot_record *new_record = &boot->records[boot->record_count];
 
+	new_record->name = name;
 	new_record->device_count = 0;
 	new_record->devices = NULL;
 
 	++boot->record_count;
 }
 
-static void boot_data_add_option(struct boot_data *boot, int id, int value)
-{
-	struct option *new_option = GROW_ARRAY(boot->options,
-					       boot->option_count);
-	if (new_option == NULL)
-		return;
-
-	new_option->id = id;
-	new_option->value = value;
-
-	++boot->option_count;
-}
-
-static void boot_data_parse_option(struct boot_data *boot, const char *line)
+static void boot_data_parse_option(struct boot_data *boot,
+				   struct str_view line)
 {
 	int i;
 	for (i = 0; i < boot->option_count; ++i) {
-		struct option *option = &boot->options[i];
+		struct boot_option *option = &boot->options[i];
 		const struct option_def *option_def = &OPTIONS[option->id];
-		const char *option_line = line;
+		const size_t keyword_len = strlen(option_def->keyword);
 
+		char value[16];
+		size_t value_len;
 		int base;
 
-		if (!skip_prefix(&option_line, option_def->keyword))
+		if (line.len < keyword_len ||
+		    memcmp(line.data, option_def->keyword, keyword_len) != 0)
 			continue;
 
+		value_len = line.len - keyword_len;
+		if (value_len >= sizeof(value))
+			value_len = sizeof(value) - 1;
+		memcpy(value, line.data + keyword_len, value_len);
+		value[value_len] = '\0';
+
 		base = (option_def->type == OPT_TYPE_HEX4 ? 16 : 10);
-		option->value = strtol(option_line, NULL, base);
+		option->value = strtol(value, NULL, base);
 		return;
 	}
 
-	fprintf(stderr, "Failed to parse option line: %s\n", line);
+	fprintf(stderr, "Failed to parse option line: %.*s\n",
+		(int)line.len, line.data);
 }
 
-static void strip(char *line)
+/* Text ends at the first NUL, which is where padding starts */
+static struct str_view text_of(const struct buffer *buffer)
 {
-	size_t line_len = strlen(line);
+	struct str_view text = { .data = buffer->data, .len = buffer->size };
+	const char *end = memchr(text.data, '\0', text.len);
 
-	if (line_len > 0 && line[line_len - 1] == '\n')
-		--line_len;
-	if (line_len > 0 && line[line_len - 1] == '\r')
-		--line_len;
-	line[line_len] = '\0';
+	if (end != NULL)
+		text.len = end - text.data;
+	return text;
 }
 
-static void boot_data_parse_map(struct boot_data *boot,
-				FILE *map_file,
-				char *record_sizes)
+/* Splits off the next line without its line terminator */
+static bool next_line(struct str_view *text, struct str_view *line)
 {
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
+	const char *eol;
+	size_t skip;
 
-	char last_record = '\0';
+	if (text->len == 0)
+		return false;
 
-	while ((read = getline(&line, &len, map_file)) != -1) {
-		if (line[0] == '\0')
-			break;
+	eol = memchr(text->data, '\n', text->len);
+
+	line->data = text->data;
+	line->len = (eol == NULL ? text->len : (size_t)(eol - text->data));
+
+	skip = line->len + (eol != NULL);
+	text->data += skip;
+	text->len -= skip;
 
-		strip(line);
-		if (strlen(line) < 3) {
-			fprintf(stderr, "Ignoring invalid map line: %s\n",
-				line);
+	if (line->len > 0 && line->data[line->len - 1] == '\r')
+		--line->len;
+	return true;
+}
+
+/* Upper bound on the number of lines */
+static int count_lines(struct str_view text)
+{
+	int count = 1;
+	const char *eol;
+
+	while ((eol = memchr(text.data, '\n', text.len)) != NULL) {
+		++count;
+		text.len -= eol + 1 - text.data;
+		text.data = eol + 1;
+	}
+
+	return count;
+}
+
+static void boot_data_parse_map(struct boot_data *boot,
+				struct str_view map_text,
+				int *record_sizes)
+{
+	struct str_view line;
+	char last_record = '\0';
+
+	while (next_line(&map_text, &line)) {
+		if (line.len < 3) {
+			fprintf(stderr, "Ignoring invalid map line: %.*s\n",
+				(int)line.len, line.data);
 			continue;
 		}
 
-		if (line[0] != last_record) {
+		if (line.data[0] != last_record) {
+			struct str_view name = {
+				.data = line.data + 2,
+				.len = line.len - 2,
+			};
+
 			if (boot->record_count == MAX_BOOT_RECORDS) {
 				fprintf(stderr,
 					"Ignoring excess records starting "
-					"with: %s\n",
-					line);
+					"with: %.*s\n",
+					(int)line.len, line.data);
 				break;
 			}
 
-			boot_data_add_record(boot, line + 2);
-			last_record = line[0];
+			boot_data_add_record(boot, name);
+			last_record = line.data[0];
 		}
 
 		++record_sizes[boot->record_count - 1];
 	}
-
-	free(line);
 }
 
 static void boot_data_parse(struct boot_data *boot,
-			    FILE *boot_file,
-			    FILE *map_file)
+			    struct str_view boot_text,
+			    struct str_view map_text,
+			    bool no_map)
 {
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
+	struct str_view line;
 
-	char record_sizes[MAX_BOOT_RECORDS] = {0};
+	int record_sizes[MAX_BOOT_RECORDS] = {0};
 	int current_record = 0;
 
-	boot_data_parse_map(boot, map_file, record_sizes);
+	boot_data_parse_map(boot, map_text, record_sizes);
 
-	while ((read = getline(&line, &len, boot_file)) != -1) {
+	while (next_line(&boot_text, &line)) {
 		struct boot_record *record;
 
-		if (line[0] == '\0')
-			break;
-
-		strip(line);
-		if (line[0] != '/') {
+		if (line.len == 0 || line.data[0] != '/') {
 			boot_data_parse_option(boot, line);
 			continue;
 		}
 
+		if (no_map && current_record == boot->record_count &&
+		    boot->record_count < MAX_BOOT_RECORDS) {
+			boot_data_add_record(boot, line);
+			record_sizes[current_record] = 1;
+		}
+
 		if (current_record == boot->record_count) {
 			fprintf(stderr,
-				"Ignoring invalid boot line (invalid map?): %s",
-				line);
+				"Ignoring invalid boot line (invalid map?): "
+				"%.*s\n",
+				(int)line.len, line.data);
 			break;
 		}
 
 		record = &boot->records[current_record];
-		boot_data_add_device(record, line);
+		boot_data_add_device(boot, record, line);
 
 		if (record->device_count == record_sizes[current_record])
 			++current_record;
 	}
-
-	free(line);
 }
 
-struct boot_data *boot_data_new(FILE *boot_file,
-				FILE *map_file,
-				bool bootorder_region)
+struct boot_data *boot_data_new(struct arena *arena,
+				const struct buffer *boot_buf,
+				const struct buffer *map_buf,
+				bool bootorder_region,
+				bool no_map)
 {
 	size_t i;
-	struct boot_data *boot = malloc(sizeof(*boot));
-
+	int max_records;
+	int max_devices;
+	struct arena own_arena = { 0 };
+	struct boot_data *boot;
+	const struct str_view boot_text = text_of(boot_buf);
+	const struct str_view map_text = text_of(map_buf);
+
+	/* Every record and device takes at least one line */
+	max_records = count_lines(no_map ? boot_text : map_text);
+	if (max_records > MAX_BOOT_RECORDS)
+		max_records = MAX_BOOT_RECORDS;
+	max_devices = count_lines(boot_text);
+
+	if (arena == NULL)
+		arena = &own_arena;
+
+	if (!arena_reset(arena,
+			 ARENA_SIZE(sizeof(*boot)) +
+			 ARENA_SIZE(sizeof(*boot->records)*max_records) +
+			 ARENA_SIZE(sizeof(*boot->devices)*max_devices) +
+			 ARENA_SIZE(sizeof(*boot->options)*ARRAY_SIZE(OPTIONS))))
+		return NULL;
+
+	boot = arena_alloc(arena, sizeof(*boot));
+	boot->records = arena_alloc(arena,
+				    sizeof(*boot->records)*max_records);
+	boot->devices = arena_alloc(arena,
+				    sizeof(*boot->devices)*max_devices);
+	boot->options = arena_alloc(arena,
+				    sizeof(*boot->options)*ARRAY_SIZE(OPTIONS));
+
+	boot->own_arena = own_arena;
 	boot->record_count = 0;
-	boot->records = NULL;
-	boot->option_count = 0;
-	boot->options = NULL;
+	boot->device_count = 0;
+	boot->option_count = ARRAY_SIZE(OPTIONS);
 	boot->bootorder_region = bootorder_region;
 
-	for (i = 0; i < ARRAY_SIZE(OPTIONS); ++i)
-		boot_data_add_option(boot, i, /*value=*/0);
+	for (i = 0; i < ARRAY_SIZE(OPTIONS); ++i) {
+		boot->options[i].id = i;
+		boot->options[i].value = 0;
+	}
 
-	boot_data_parse(boot, boot_file, map_file);
+	boot_data_parse(boot, boot_text, map_text, no_map);
 
 	return boot;
 }
 
 void boot_data_free(struct boot_data *boot)
 {
-	int i;
-
-	for (i = 0; i < boot->record_count; ++i) {
-		int j;
-		struct boot_record *record = &boot->records[i];
+	/* Boot data resides in the arena, so copy it out before freeing */
+	struct arena own_arena = boot->own_arena;
 
-		for (j = 0; j < record->device_count; ++j)
-			free(record->devices[j]);
-
-		free(record->devices);
-		free(record->name);
-	}
-
-	free(boot->options);
-	free(boot);
+	arena_free(&own_arena);
 }
 
 void boot_data_move(struct boot_data *boot, int from, int to)
@@ -219,7 +270,7 @@ void boot_data_move(struct boot_data *boot, int from, int to)
 		ROTATE_LEFT(&boot->records[from], to - from + 1);
 }
 
-bool boot_data_set_option(struct option *option, int value)
+bool boot_data_set_option(struct boot_option *option, int value)
 {
 	const struct option_def *option_def = &OPTIONS[option->id];
 	if (option_def->type != OPT_TYPE_HEX4) {
@@ -234,14 +285,40 @@ bool boot_data_set_option(struct option *option, int value)
 	return true;
 }
 
-void boot_data_dump_boot(struct boot_data *boot, FILE *file)
+/* Appends formatted output to the buffer, *used is the size of data in it */
+static bool buffer_printf(struct buffer *out, size_t *used,
+			  const char format[], ...)
+	__attribute__ ((format(printf, 3, 4)));
+
+static bool buffer_printf(struct buffer *out, size_t *used,
+			  const char format[], ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(out->data + *used, out->size - *used, format, ap);
+	va_end(ap);
+
+	if (len < 0 || (size_t)len >= out->size - *used)
+		return false;
+
+	*used += len;
+	return true;
+}
+
+bool boot_data_dump_boot(struct boot_data *boot, struct buffer *out)
 {
 	int i;
+	size_t used = 0;
+	bool ok = true;
 
 	for (i = 0; i < boot->record_count; ++i) {
 		int j;
 		for (j = 0; j < boot->records[i].device_count; ++j)
-			fprintf(file, "%s\r\n", boot->records[i].devices[j]);
+			ok = ok && buffer_printf(out, &used, "%.*s\r\n",
+					(int)boot->records[i].devices[j].len,
+					boot->records[i].devices[j].data);
 	}
 
 	for (i = 0; i < boot->option_count; ++i) {
@@ -249,24 +326,36 @@ void boot_data_dump_boot(struct boot_data *boot, FILE *file)
 		const struct option_def *option_def = &OPTIONS[id];
 
 		if (option_def->type == OPT_TYPE_HEX4)
-			fprintf(file, "%s%04x\r\n",
-				option_def->keyword,
-				boot->options[i].value);
+			ok = ok && buffer_printf(out, &used, "%s%04x\r\n",
+						 option_def->keyword,
+						 boot->options[i].value);
 		else
-			fprintf(file, "%s%d\r\n",
-				option_def->keyword,
-				boot->options[i].value);
+			ok = ok && buffer_printf(out, &used, "%s%d\r\n",
+						 option_def->keyword,
+						 boot->options[i].value);
 	}
+
+	if (ok)
+		buffer_set_size(out, used);
+	return ok;
 }
 
-void boot_data_dump_map(struct boot_data *boot, FILE *file)
+bool boot_data_dump_map(struct boot_data *boot, struct buffer *out)
 {
 	int i;
+	size_t used = 0;
+	bool ok = true;
+
 	for (i = 0; i < boot->record_count; ++i) {
 		int j;
 		for (j = 0; j < boot->records[i].device_count; ++j)
-			fprintf(file, "%c %s\r\n",
-				'a' + i,
-				boot->records[i].name);
+			ok = ok && buffer_printf(out, &used, "%c %.*s\r\n",
+						 'a' + i,
+						 (int)boot->records[i].name.len,
+						 boot->records[i].name.data);
 	}
+
+	if (ok)
+		buffer_set_size(out, used);
+	return ok;
 }
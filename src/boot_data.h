@@ -4,10 +4,13 @@
 #define BOOT_DATA_H__
 
 #include <stdbool.h>
-#include <stdio.h>
+
+#include "utils.h"
 
 #define MAX_BOOT_RECORDS 64
 
+struct buffer;
+
 enum option_type
 {
 	OPT_TYPE_BOOLEAN,
@@ -24,7 +27,7 @@ struct option_def
 	const char *toggle_options[2];
 };
 
-struct option
+struct boot_option
 {
 	int id;
 	int value;
@@ -32,34 +35,61 @@ struct option
 
 struct boot_record
 {
-	char *name;
+	struct str_view name;
 
 	int device_count;
-	char **devices;
+	struct str_view *devices;
 };
 
+/*
+ * Names and devices refer to the buffers boot data was created from, those
+ * must not be modified or released while boot data is in use.
+ */
 struct boot_data
 {
 	int record_count;
 	struct boot_record *records;
 
+	/* Devices of all records, each record refers to a slice of it */
+	int device_count;
+	struct str_view *devices;
+
 	int option_count;
-	struct option *options;
+	struct boot_option *options;
 
-	/* Whether we use BOOTORDER region and not a CBFS file. */
+	/* Whether we use BOOTORDER region and not a CBFS file.  Boot data is
+	 * stored where it was loaded from. */
 	bool bootorder_region;
+
+	/* Arena boot data resides in unless it was provided by the caller */
+	struct arena own_arena;
 };
 
-struct boot_data *boot_data_new(FILE *boot_file,
-				FILE *map_file,
-				bool bootorder_region);
+/*
+ * Everything boot data needs is allocated from a single arena.  If arena is
+ * NULL, boot data gets an arena of its own.  Otherwise the arena is reset,
+ * which invalidates boot data previously created in it, and reused.  If no_map
+ * is set (partial images have no map), every device becomes a record named by
+ * its path.  An empty map of a full image doesn't do that.
+ */
+struct boot_data *boot_data_new(struct arena *arena,
+				const struct buffer *boot_file,
+				const struct buffer *map_file,
+				bool bootorder_region,
+				bool no_map);
+/* Doesn't free arena passed to boot_data_new() */
 void boot_data_free(struct boot_data *boot);
 
 void boot_data_move(struct boot_data *boot, int from, int to);
-bool boot_data_set_option(struct option *option, int value);
-
-void boot_data_dump_boot(struct boot_data *boot, FILE *file);
-void boot_data_dump_map(struct boot_data *boot, FILE *file);
+bool boot_data_set_option(struct boot_option *option, int value);
+
+/*
+ * Serialize into a preallocated buffer whose size is the capacity.  On success
+ * buffer's size is shrunk to the amount of data written.  Returns false if the
+ * data doesn't fit.
+ */
+bool boot_data_dump_boot(struct boot_data *boot, struct buffer *out);
+bool boot_data_dump_map(struct boot_data *boot, struct buffer *out);
 
 static const struct option_def OPTIONS[] =
 {
@@ -2,16 +2,16 @@
 
 #include "cbfs.h"
 
-#include <unistd.h>
-
-#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 
 #include "boot_data.h"
+#include "flash_layout.h"
+#include "fmap_cache.h"
 #include "utils.h"
 
 #include "third-party/cbfs_image.h"
+#include "third-party/io_engine.h"
 #include "third-party/partitioned_file.h"
 
 #define CBFS_REGION      "COREBOOT"
@@ -20,273 +20,687 @@
 #define BOOTORDER_DEF    "bootorder_def"
 #define BOOTORDER_MAP    "bootorder_map"
 
-static FILE *read_from_rom(partitioned_file_t *pf,
-			   const char *name,
-			   bool is_region)
+/* Size of SPI flash sector that bootorder file is padded to */
+#define SECTOR_SIZE 4096
+
+/* Lazily mapped images are read by whole pages */
+#define READ_PAGE_SIZE 4096
+
+/* Ends bootorder file, preceded by as many '\0' as needed to fill a sector */
+#define PAD_MESSAGE "this file needs to be 4096 bytes long in order to " \
+		    "entirely fill 1 spi flash sector"
+#define PAD_LEN     (sizeof(PAD_MESSAGE) - 1)
+
+struct cbfs_session
 {
-	FILE *fp;
-	struct cbfs_file *entry;
-	struct buffer region;
+	/* Changes to the output file after it's written */
+	const char *rom_file;
+	const char *output_file;
+	bool write_access;
+	bool fmap_cache;
+	bool report_blocks;
+	const char *layout_file;
+	/* Only BOOTORDER region is there, CBFS is absent */
+	bool partial;
+
+	partitioned_file_t *pf;
 	struct cbfs_image cbfs;
-	const char *region_name = (is_region ? name : CBFS_REGION);
+};
 
-	if (!partitioned_file_read_region(&region, pf, region_name)) {
-		/* ERROR("The image will be left unmodified.\n"); */
-		return NULL;
+/* Looks up FMAP in the cache unless its location was specified explicitly */
+static long fmap_offset_hint(const char *rom_file,
+			     const struct cbfs_open_options *options,
+			     struct fmap_cache_entry *cached)
+{
+	if (options->fmap_offset >= 0 || !options->fmap_cache ||
+	    options->fmap_file != NULL ||
+	    !fmap_cache_lookup(rom_file, cached)) {
+		memset(cached, 0, sizeof(*cached));
+		cached->fmap_offset = options->fmap_offset;
+	}
+
+	return cached->fmap_offset;
+}
+
+static bool is_boot_file(const char *name)
+{
+	return strcmp(name, BOOTORDER_FILE) == 0 ||
+	       strcmp(name, BOOTORDER_DEF) == 0 ||
+	       strcmp(name, BOOTORDER_MAP) == 0;
+}
+
+/*
+ * Lists pages of CBFS that loading reads: headers of all files, which are
+ * walked to index CBFS, and contents of files with boot data.  Offsets are
+ * relative to the image.
+ */
+static bool collect_cbfs_ranges(struct cbfs_session *session,
+				const struct fmap *fmap,
+				struct fmap_cache_entry *entry)
+{
+	VECTOR(struct fmap_cache_range) ranges = { 0 };
+	struct cbfs_image *image = &session->cbfs;
+	const struct fmap_area *area = fmap_find_area(fmap, CBFS_REGION);
+	struct cbfs_file *file;
+
+	entry->ranges = NULL;
+	entry->range_count = 0;
+
+	if (session->partial || area == NULL)
+		return true;
+
+	for (file = cbfs_find_first_entry(image);
+	     file && cbfs_is_valid_entry(image, file);
+	     file = cbfs_find_next_entry(image, file)) {
+		struct fmap_cache_range *range;
+		uint64_t start = area->offset + cbfs_get_entry_addr(image, file);
+		uint64_t end = start + ntohl(file->offset);
+
+		if (is_boot_file(file->filename))
+			end += ntohl(file->len);
+
+		start -= start % READ_PAGE_SIZE;
+		end += (READ_PAGE_SIZE - end % READ_PAGE_SIZE) % READ_PAGE_SIZE;
+
+		/* Files are walked in order, so only the last range can
+		 * share pages with this one */
+		range = (ranges.count == 0 ? NULL
+					   : &ranges.data[ranges.count - 1]);
+		if (range != NULL && range->offset + range->size >= start) {
+			if (range->offset + range->size < end)
+				range->size = end - range->offset;
+			continue;
+		}
+
+		range = VECTOR_GROW(ranges);
+		if (range == NULL) {
+			VECTOR_FREE(ranges);
+			return false;
+		}
+
+		range->offset = start;
+		range->size = end - start;
+		++ranges.count;
 	}
 
-	if(is_region) {
-		FILE *fp = fmemopen(NULL, region.size, "w+");
-		fwrite(region.data, 1, region.size, fp);
-		rewind(fp);
-		return fp;
+	entry->ranges = ranges.data;
+	entry->range_count = ranges.count;
+	return true;
+}
+
+/* Stores FMAP location and CBFS ranges in the cache if they aren't there */
+static void update_fmap_cache(struct cbfs_session *session,
+			      const struct fmap_cache_entry *cached)
+{
+	const struct fmap *fmap = partitioned_file_get_fmap(session->pf);
+	struct fmap_cache_entry entry = {
+		.fmap_offset = partitioned_file_fmap_offset(session->pf),
+		.fmap = (struct fmap *)fmap,
+	};
+
+	/* FMAP read from a separate file has no offset worth caching */
+	if (!session->fmap_cache || entry.fmap_offset < 0)
+		return;
+
+	if (!collect_cbfs_ranges(session, fmap, &entry))
+		return;
+
+	if (cached == NULL || cached->fmap == NULL ||
+	    cached->fmap_offset != entry.fmap_offset ||
+	    memcmp(cached->fmap, fmap, fmap_size(fmap)) != 0 ||
+	    cached->range_count != entry.range_count ||
+	    memcmp(cached->ranges, entry.ranges,
+		   entry.range_count * sizeof(*entry.ranges)) != 0)
+		(void)fmap_cache_store(session->rom_file, &entry);
+
+	free(entry.ranges);
+}
+
+struct cbfs_session *cbfs_session_open(const char *rom_file,
+				       const struct cbfs_open_options *options)
+{
+	struct buffer region;
+	struct fmap_cache_entry cached;
+	struct partitioned_file_params params;
+	struct cbfs_session *session = calloc(1, sizeof(*session));
+
+	if (session == NULL) {
+		fprintf(stderr, "Failed to allocate session for %s\n",
+			rom_file);
+		return NULL;
 	}
 
-	if (cbfs_image_from_buffer(&cbfs, &region, ~0u) != 0)
+	session->rom_file = rom_file;
+	session->output_file = options->output_file;
+	session->write_access = options->write_access;
+	session->fmap_cache = options->fmap_cache;
+	session->report_blocks = options->report_blocks;
+	session->layout_file = options->layout_file;
+	session->partial = options->partial;
+
+	/* Input isn't modified when output goes elsewhere */
+	params.write_access = options->write_access &&
+			      options->output_file == NULL;
+	params.fmap_offset = fmap_offset_hint(rom_file, options, &cached);
+	/* Reading leaves most of the image alone, don't fetch all of it */
+	params.lazy = !options->write_access;
+	params.fmap_file = options->fmap_file;
+	params.partial = options->partial;
+	params.atomic = options->atomic;
+	params.output_file = options->output_file;
+
+	session->pf = partitioned_file_open(rom_file, &params);
+	if (session->pf == NULL) {
+		fprintf(stderr, "Failed to open ROM file for %s: %s\n",
+			options->write_access ? "writing" : "reading",
+			rom_file);
+		fmap_cache_entry_free(&cached);
+		free(session);
 		return NULL;
+	}
 
-	entry = cbfs_get_entry(&cbfs, name);
+	if (!session->partial) {
+		if (!partitioned_file_read_region(&region, session->pf,
+						  CBFS_REGION) ||
+		    cbfs_image_from_buffer(&session->cbfs, &region, ~0u,
+					   options->count_headers) != 0) {
+			fmap_cache_entry_free(&cached);
+			cbfs_session_close(session);
+			return NULL;
+		}
 
-	fp = fmemopen(NULL, ntohl(entry->len), "w+");
-	fwrite(CBFS_SUBHEADER(entry), 1, ntohl(entry->len), fp);
-	rewind(fp);
-	return fp;
+		/* Flash chips are erased and written by whole sectors */
+		session->cbfs.erase_block_size = SECTOR_SIZE;
+	}
+
+	/* CBFS ranges are known only after CBFS is walked */
+	update_fmap_cache(session, &cached);
+	fmap_cache_entry_free(&cached);
+
+	return session;
 }
 
-struct boot_data *cbfs_load_boot_data(const char *rom_file)
+void cbfs_session_close(struct cbfs_session *session)
 {
-	FILE *boot_file;
-	FILE *map_file;
-	partitioned_file_t *pf;
-	struct boot_data *boot = NULL;
-	bool bootorder_region = true;
+	if (session == NULL)
+		return;
 
-	pf = partitioned_file_reopen(rom_file, /*write_access=*/false);
-	if (pf == NULL) {
-		fprintf(stderr, "Failed to open ROM file for reading: %s\n",
-			rom_file);
-		goto failure;
+	cbfs_image_release(&session->cbfs);
+	partitioned_file_close(session->pf);
+	free(session);
+}
+
+void cbfs_prefetch(const char *rom_file,
+		   const struct cbfs_open_options *options)
+{
+	struct fmap_cache_entry cached;
+	const struct fmap_area *area;
+	struct io_range *ranges;
+	size_t count = 0;
+	uint32_t i;
+
+	/* Searching for FMAP reads the whole image anyway */
+	if (fmap_offset_hint(rom_file, options, &cached) < 0)
+		return;
+
+	/* FMAP, BOOTORDER region and CBFS ranges */
+	ranges = calloc(cached.range_count + 2, sizeof(*ranges));
+	if (ranges == NULL) {
+		fmap_cache_entry_free(&cached);
+		return;
 	}
 
-	boot_file = read_from_rom(pf, BOOTORDER_REGION, /*is_region=*/true);
-	if (boot_file == NULL) {
-		/* Use bootorder file if corresponding region is missing. */
-		bootorder_region = false;
-		boot_file = read_from_rom(pf, BOOTORDER_FILE,
-					  /*is_region=*/false);
+	if (cached.fmap == NULL) {
+		/* Only offset is known, area table follows FMAP's header */
+		ranges[count].offset = cached.fmap_offset;
+		ranges[count++].size = READ_PAGE_SIZE;
+	} else {
+		ranges[count].offset = cached.fmap_offset;
+		ranges[count++].size = fmap_size(cached.fmap);
+
+		area = fmap_find_area(cached.fmap, BOOTORDER_REGION);
+		if (area != NULL) {
+			ranges[count].offset = area->offset;
+			ranges[count++].size = area->size;
+		}
+
+		for (i = 0; i < cached.range_count; ++i) {
+			ranges[count].offset = cached.ranges[i].offset;
+			ranges[count++].size = cached.ranges[i].size;
+		}
 	}
-	if (boot_file == NULL)
-		goto failure;
 
-	map_file = read_from_rom(pf, BOOTORDER_MAP, /*is_region=*/false);
-	if (map_file == NULL) {
-		(void)fclose(boot_file);
-		goto failure;
+	io_engine_prefetch(rom_file, ranges, count);
+
+	free(ranges);
+	fmap_cache_entry_free(&cached);
+}
+
+/* Makes dest refer to data of a region or a CBFS file without copying it */
+static bool read_from_rom(struct cbfs_session *session,
+			  const char *name,
+			  bool is_region,
+			  struct buffer *dest)
+{
+	struct cbfs_file *entry;
+
+	if (is_region)
+		return partitioned_file_read_region(dest, session->pf, name);
+
+	entry = cbfs_get_entry(&session->cbfs, name);
+	if (entry == NULL) {
+		fprintf(stderr, "CBFS file %s not found\n", name);
+		return false;
 	}
 
-	boot = boot_data_new(boot_file, map_file, bootorder_region);
+	buffer_init(dest, NULL, CBFS_SUBHEADER(entry), ntohl(entry->len));
+	return true;
+}
 
-	(void)fclose(boot_file);
-	(void)fclose(map_file);
+/* Finds bootorder, storing goes to the same place loading reads from */
+static bool find_bootorder(struct cbfs_session *session,
+			   struct buffer *boot_file,
+			   bool *bootorder_region)
+{
+	*bootorder_region = true;
+	if (read_from_rom(session, BOOTORDER_REGION, /*is_region=*/true,
+			  boot_file))
+		return true;
 
-failure:
-	partitioned_file_close(pf);
-	return boot;
+	/* Partial images have nothing but BOOTORDER region */
+	if (session->partial)
+		return false;
+
+	/* Use bootorder file if corresponding region is missing. */
+	*bootorder_region = false;
+	return read_from_rom(session, BOOTORDER_FILE, /*is_region=*/false,
+			     boot_file);
 }
 
-static FILE *fopen_wrapper(const char *path, const char *mode)
+struct boot_data *cbfs_load_boot_data(struct cbfs_session *session,
+				      struct arena *arena)
 {
-	FILE *file = fopen(path, mode);
+	struct buffer boot_file;
+	struct buffer map_file;
+	bool bootorder_region;
+
+	if (!find_bootorder(session, &boot_file, &bootorder_region))
+		return NULL;
 
-	if (file == NULL)
-		fprintf(stderr, "Failed to open file %s: %s\n", path,
-			strerror(errno));
+	if (session->partial) {
+		/* There is no map outside of CBFS */
+		buffer_init(&map_file, NULL, (char *)"", 0);
+		return boot_data_new(arena, &boot_file, &map_file,
+				     bootorder_region, /*no_map=*/true);
+	}
 
-	return file;
+	if (!read_from_rom(session, BOOTORDER_MAP, /*is_region=*/false,
+			   &map_file))
+		return NULL;
+
+	return boot_data_new(arena, &boot_file, &map_file,
+			     bootorder_region, /*no_map=*/false);
 }
 
-static bool fclose_wrapper(FILE *file, const char *path)
+/* Fills the rest of the sector the way coreboot's build does */
+static bool pad_buffer(struct buffer *buffer)
 {
-	if (fclose(file) != 0)
+	size_t fill_amount;
+
+	if (buffer->size > SECTOR_SIZE - PAD_LEN) {
 		fprintf(stderr,
-			"Failed to close file %s: %s\n",
-			path,
-			strerror(errno));
+			"Boot file is greater than 4096 bytes: %zu\n",
+			buffer->size);
+		return false;
+	}
+
+	fill_amount = SECTOR_SIZE - PAD_LEN - buffer->size;
+	memset(buffer->data + buffer->size, '\0', fill_amount);
+	memcpy(buffer->data + buffer->size + fill_amount, PAD_MESSAGE,
+	       PAD_LEN);
 
-	return file;
+	buffer->size = SECTOR_SIZE;
+	return true;
 }
 
-static bool pad_file(FILE *file)
+/* Finds region to be overwritten by content and checks that content fills it */
+static bool prepare_region(struct cbfs_session *session,
+			   const char *name,
+			   const struct buffer *content,
+			   struct buffer *region)
 {
-	long size;
-	int fill_amount;
-	const int target_size = 4096;
-	const char *pad_message = "this file needs to be 4096 bytes long in "
-				  "order to entirely fill 1 spi flash sector";
-
-	fseek(file, 0, SEEK_END);
+	if (!partitioned_file_read_region(region, session->pf, name)) {
+		fprintf(stderr, "Failed to read ROM's region\n");
+		return false;
+	}
 
-	size = ftell(file);
-	if (size > target_size - (long)strlen(pad_message)) {
+	if (content->size < region->size) {
 		fprintf(stderr,
-			"Boot file is greater than 4096 bytes: %ld\n", size);
+			"Incomplete data for region: %lld out of %lld\n",
+			(long long)content->size,
+			(long long)region->size);
 		return false;
 	}
 
-	fill_amount = target_size - strlen(pad_message) - size;
-	while (fill_amount-- > 0)
-		fputc('\0', file);
+	return true;
+}
+
+/* Marks parts of CBFS changed by a transaction for writing */
+static bool write_cbfs_changes(struct cbfs_session *session,
+			       const struct cbfs_transaction *txn)
+{
+	size_t i;
+
+	for (i = 0; i < txn->touched_count; ++i) {
+		const struct cbfs_extent *extent = &txn->touched[i];
+		struct buffer changed;
 
-	fputs(pad_message, file);
+		buffer_splice(&changed, &session->cbfs.buffer, extent->addr,
+			      extent->end - extent->addr);
+		if (!partitioned_file_write_region(session->pf, &changed))
+			return false;
+	}
 
 	return true;
 }
 
-static off_t get_file_size(FILE *fp)
+/* Lists erase blocks that differ from the image on disk */
+static bool report_changed_blocks(struct cbfs_session *session)
 {
-	off_t fsize;
-	fseek(fp, 0, SEEK_END);
-	fsize = ftell(fp);
-	rewind(fp);
-	return fsize;
+	size_t *blocks;
+	long count;
+	long i;
+
+	count = partitioned_file_changed_blocks(session->pf, SECTOR_SIZE,
+						&blocks);
+	if (count < 0)
+		return false;
+
+	/* Keep lists of images processed in parallel apart */
+	flockfile(stdout);
+	printf("Changed %d KiB erase blocks of %s: %ld\n", SECTOR_SIZE / 1024,
+	       session->rom_file, count);
+	for (i = 0; i < count; ++i)
+		printf("  0x%08zx\n", blocks[i]);
+	funlockfile(stdout);
+
+	free(blocks);
+	return true;
 }
 
-static bool buffer_from_fp(struct buffer *buffer, FILE *fp)
+/* Serialized boot data as it's stored in an image */
+struct cbfs_blobs
+{
+	/* Contents of bootorder padded to a whole sector */
+	char boot[SECTOR_SIZE];
+	/* Size of bootorder before padding, which is bootorder_def */
+	size_t boot_size;
+	/* Contents of bootorder_map, which isn't padded */
+	char map[SECTOR_SIZE];
+	size_t map_size;
+	/* Map is optional when blobs are loaded from files */
+	bool has_map;
+};
+
+static bool serialize_boot_data(struct boot_data *boot,
+				struct cbfs_blobs *blobs)
 {
-	size_t nread;
+	struct buffer boot_file;
+	struct buffer map_file;
 
-	off_t file_size = get_file_size(fp);
-	if (file_size < 0) {
-		fprintf(stderr, "could not determine size of a file\n");
-		(void)fclose_wrapper(fp, "<temporary>");
-		return -1;
+	buffer_init(&boot_file, NULL, blobs->boot, sizeof(blobs->boot));
+	if (!boot_data_dump_boot(boot, &boot_file)) {
+		fprintf(stderr, "Boot file is greater than 4096 bytes\n");
+		return false;
 	}
+	blobs->boot_size = boot_file.size;
+	if (!pad_buffer(&boot_file))
+		return false;
 
-	buffer->offset = 0;
-	buffer->size = file_size;
-	buffer->name = NULL;
-	buffer->data = malloc(buffer->size);
-	assert(buffer->data);
-
-	nread = fread(buffer->data, 1, buffer->size, fp);
-	if (nread != buffer->size) {
-		fprintf(stderr, "Incomplete read of file: %lld out of %lld\n",
-			(long long)nread, (long long)buffer->size);
-		buffer_delete(buffer);
+	buffer_init(&map_file, NULL, blobs->map, sizeof(blobs->map));
+	if (!boot_data_dump_map(boot, &map_file)) {
+		fprintf(stderr, "Map file is greater than 4096 bytes\n");
 		return false;
 	}
 
+	blobs->map_size = map_file.size;
+	blobs->has_map = true;
 	return true;
 }
 
-static bool update_in_rom(partitioned_file_t *pf,
-			  const char *name,
-			  bool is_region,
-			  FILE *fp)
+struct cbfs_blobs *cbfs_blobs_new(struct boot_data *boot)
 {
-	struct buffer region;
-	struct buffer cbfs_file;
-	struct cbfs_image cbfs;
-	struct cbfs_file *file_header;
-	const char *region_name = (is_region ? name : CBFS_REGION);
+	struct cbfs_blobs *blobs = calloc(1, sizeof(*blobs));
 
-	rewind(fp);
+	if (blobs != NULL && !serialize_boot_data(boot, blobs)) {
+		free(blobs);
+		return NULL;
+	}
 
-	if (!partitioned_file_read_region(&region, pf, region_name)) {
-		fprintf(stderr, "Failed to read ROM's region\n");
+	return blobs;
+}
+
+/* Reads up to capacity bytes of a file, larger files are an error */
+static bool read_blob(const char *path, char *data, size_t capacity,
+		      size_t *size)
+{
+	FILE *file;
+	char extra;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		perror(path);
 		return false;
 	}
 
-	if (is_region) {
-		const size_t nread = fread(region.data, 1, region.size, fp);
-		if (nread != region.size) {
-			fprintf(stderr,
-				"Incomplete read of file: %lld out of %lld\n",
-				(long long)nread, (long long)region.size);
-			return false;
-		}
+	*size = fread(data, 1, capacity, file);
+	if (ferror(file) || fread(&extra, 1, 1, file) != 0) {
+		fprintf(stderr, "Failed to read %s or it's larger than %zu "
+			"bytes\n", path, capacity);
+		fclose(file);
+		return false;
+	}
+
+	fclose(file);
+	return true;
+}
+
+struct cbfs_blobs *cbfs_blobs_load(const char *boot_file,
+				   const char *map_file)
+{
+	size_t boot_size;
+	struct cbfs_blobs *blobs = calloc(1, sizeof(*blobs));
+
+	if (blobs == NULL)
+		return NULL;
+
+	if (!read_blob(boot_file, blobs->boot, sizeof(blobs->boot),
+		       &boot_size))
+		goto failure;
 
-		return partitioned_file_write_region(pf, &region);
+	if (boot_size != sizeof(blobs->boot) ||
+	    memcmp(blobs->boot + SECTOR_SIZE - PAD_LEN, PAD_MESSAGE,
+		   PAD_LEN) != 0) {
+		fprintf(stderr, "Boot blob must be exactly %zu bytes ending "
+			"with padding: %s\n", sizeof(blobs->boot), boot_file);
+		goto failure;
+	}
+	/* Bootorder never contains '\0', which pads it up to the message */
+	blobs->boot_size = strnlen(blobs->boot, SECTOR_SIZE - PAD_LEN);
+
+	if (map_file != NULL) {
+		if (!read_blob(map_file, blobs->map, sizeof(blobs->map),
+			       &blobs->map_size))
+			goto failure;
+		blobs->has_map = true;
 	}
 
-	if (cbfs_image_from_buffer(&cbfs, &region, ~0u) != 0)
-		return false;
+	return blobs;
+
+failure:
+	free(blobs);
+	return NULL;
+}
+
+static bool write_blob(const char *path, const char *data, size_t size)
+{
+	FILE *file;
+	bool success;
 
-	if (cbfs_remove_entry(&cbfs, name) != 0)
+	if (path == NULL)
+		return true;
+
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		perror(path);
 		return false;
+	}
+
+	success = (fwrite(data, 1, size, file) == size);
+	success &= (fclose(file) == 0);
+
+	if (!success)
+		fprintf(stderr, "Failed to write %s\n", path);
+	return success;
+}
+
+bool cbfs_blobs_save(const struct cbfs_blobs *blobs,
+		     const char *boot_file,
+		     const char *map_file)
+{
+	return write_blob(boot_file, blobs->boot, sizeof(blobs->boot)) &&
+	       (!blobs->has_map ||
+		write_blob(map_file, blobs->map, blobs->map_size));
+}
+
+void cbfs_blobs_free(struct cbfs_blobs *blobs)
+{
+	free(blobs);
+}
+
+/* Updates CBFS files all at once */
+static bool update_cbfs_files(struct cbfs_session *session,
+			      struct cbfs_transaction *txn,
+			      const struct cbfs_blobs *blobs,
+			      bool bootorder_region)
+{
+	struct buffer boot_file;
+	struct buffer def_file;
+	struct buffer map_file;
 
-	if (!buffer_from_fp(&cbfs_file, fp))
+	/* bootorder_def is the same data as bootorder, but without padding */
+	buffer_init(&boot_file, NULL, (char *)blobs->boot, sizeof(blobs->boot));
+	buffer_init(&def_file, NULL, (char *)blobs->boot, blobs->boot_size);
+	buffer_init(&map_file, NULL, (char *)blobs->map, blobs->map_size);
+
+	/* Stage all updates and make sure they fit before applying any */
+
+	if (cbfs_transaction_replace(txn, BOOTORDER_DEF, CBFS_TYPE_RAW,
+				     &def_file) != 0)
 		return false;
 
-	file_header =
-		cbfs_create_file_header(CBFS_TYPE_RAW, cbfs_file.size, name);
+	if (!bootorder_region &&
+	    cbfs_transaction_replace(txn, BOOTORDER_FILE, CBFS_TYPE_RAW,
+				     &boot_file) != 0)
+		return false;
 
-	if (cbfs_add_entry(&cbfs, &cbfs_file, /*offset=*/0, file_header,
-			   /*len_align=*/0) != 0)
+	if (blobs->has_map &&
+	    cbfs_transaction_replace(txn, BOOTORDER_MAP, CBFS_TYPE_RAW,
+				     &map_file) != 0)
 		return false;
 
-	return partitioned_file_write_region(pf, &region);
+	return cbfs_transaction_commit(txn) == 0 &&
+	       write_cbfs_changes(session, txn);
 }
 
-bool cbfs_store_boot_data(struct boot_data *boot, const char *rom_file)
+/* bootorder_region is where bootorder was loaded from */
+static bool store_blobs(struct cbfs_session *session,
+			const struct cbfs_blobs *blobs,
+			bool bootorder_region)
 {
-	FILE *file = NULL;
-	partitioned_file_t *pf = NULL;
-	char template[] = "/tmp/cb-order.XXXXXX";
-	const char *bootorder_name =
-		(boot->bootorder_region ? BOOTORDER_REGION : BOOTORDER_FILE);
+	struct buffer boot_file;
+	struct buffer region;
+	struct cbfs_transaction txn;
 
-	/* Create temporary file which will be reused */
+	cbfs_transaction_init(&txn, &session->cbfs);
 
-	file = temp_file(template);
-	if (file == NULL) {
-		fprintf(stderr, "Failed to create a temporary file: %s\n",
-			strerror(errno));
+	if (!session->write_access) {
+		fprintf(stderr, "ROM file was opened read-only: %s\n",
+			session->rom_file);
 		goto failure;
 	}
 
-	pf = partitioned_file_reopen(rom_file, /*write_access=*/true);
-	if (pf == NULL) {
-		fprintf(stderr, "Failed to open ROM file for writing: %s\n",
-			rom_file);
+	if (!session->partial &&
+	    !update_cbfs_files(session, &txn, blobs, bootorder_region))
 		goto failure;
-	}
 
-	/* bootorder_def */
+	if (bootorder_region) {
+		buffer_init(&boot_file, NULL, (char *)blobs->boot,
+			    sizeof(blobs->boot));
+		if (!prepare_region(session, BOOTORDER_REGION, &boot_file,
+				    &region))
+			goto failure;
 
-	boot_data_dump_boot(boot, file);
-	if (!update_in_rom(pf, BOOTORDER_DEF, /*is_region=*/false, file))
-		goto failure;
+		memcpy(region.data, boot_file.data, region.size);
+		if (!partitioned_file_write_region(session->pf, &region))
+			goto failure;
+	}
 
-	/* bootorder */
+	cbfs_transaction_release(&txn);
 
-	/* Same data, but padded */
-	if (!pad_file(file))
+	/* Compared against the image before it's overwritten */
+	if (session->report_blocks && !report_changed_blocks(session))
 		goto failure;
-	if (!update_in_rom(pf, bootorder_name, boot->bootorder_region, file))
+	if (session->layout_file != NULL &&
+	    !flash_layout_write(session->layout_file, session->pf,
+				SECTOR_SIZE))
 		goto failure;
 
-	/* bootorder_map */
-
-	if (!fclose_wrapper(file, template))
-		goto failure;
-	file = fopen_wrapper(template, "w+");
-	if (file == NULL)
+	/* Nothing is written to the image until all updates succeed */
+	if (!partitioned_file_commit(session->pf))
 		goto failure;
 
-	boot_data_dump_map(boot, file);
-	if (!update_in_rom(pf, BOOTORDER_MAP, /*is_region=*/false, file))
-		goto failure;
+	/* From now on the output file is being edited */
+	if (session->output_file != NULL) {
+		session->rom_file = session->output_file;
+		session->output_file = NULL;
+	}
+
+	/* Modification time has changed */
+	update_fmap_cache(session, /*cached=*/NULL);
 
-	if (!fclose_wrapper(file, template))
-		goto failure;
-	partitioned_file_close(pf);
 	return true;
 
 failure:
-	if (file != 0)
-		(void)fclose_wrapper(file, template);
-	partitioned_file_close(pf);
+	cbfs_transaction_release(&txn);
 	fprintf(stderr, "Updating ROM image has failed\n");
 	return false;
 }
+
+bool cbfs_store_boot_data(struct cbfs_session *session, struct boot_data *boot)
+{
+	struct cbfs_blobs blobs;
+
+	/* Serialize everything before the image is modified */
+	if (!serialize_boot_data(boot, &blobs)) {
+		fprintf(stderr, "Updating ROM image has failed\n");
+		return false;
+	}
+
+	return store_blobs(session, &blobs, boot->bootorder_region);
+}
+
+bool cbfs_store_blobs(struct cbfs_session *session,
+		      const struct cbfs_blobs *blobs)
+{
+	struct buffer boot_file;
+	bool bootorder_region;
+
+	/* Nothing was loaded, so look for bootorder the way loading does */
+	if (!find_bootorder(session, &boot_file, &bootorder_region)) {
+		fprintf(stderr, "Updating ROM image has failed\n");
+		return false;
+	}
+
+	return store_blobs(session, blobs, bootorder_region);
+}
@@ -5,9 +5,76 @@
 
 #include <stdbool.h>
 
+#include "third-party/partitioned_file.h"
+
+struct arena;
 struct boot_data;
 
-struct boot_data *cbfs_load_boot_data(const char *rom_file);
-bool cbfs_store_boot_data(struct boot_data *boot, const char *rom_file);
+/* ROM image which stays open and locked between loading and storing */
+struct cbfs_session;
+
+/* ROM file name which makes session read image from stdin and store it to
+ * stdout */
+#define CBFS_STDIO_FILE PARTITIONED_FILE_STDIO
+
+struct cbfs_open_options
+{
+	bool write_access;
+	/* Expected offset of FMAP or -1 if unknown */
+	long fmap_offset;
+	/* Whether to remember where FMAP is in a file next to the image */
+	bool fmap_cache;
+	/* Whether to warn about several CBFS master headers in legacy images,
+	 * which costs a full scan of them */
+	bool count_headers;
+	/* Whether to print which flash erase blocks a save changes */
+	bool report_blocks;
+	/* Where to write flashrom layout of changed blocks on save or NULL */
+	const char *layout_file;
+	/* Whether the image is a dump of just FMAP and BOOTORDER regions */
+	bool partial;
+	/* File to read FMAP from instead of the image or NULL */
+	const char *fmap_file;
+	/* Whether to save into a copy which then replaces the image */
+	bool atomic;
+	/* Where to save modified image instead of the image itself or NULL */
+	const char *output_file;
+};
+
+struct cbfs_session *cbfs_session_open(const char *rom_file,
+				       const struct cbfs_open_options *options);
+void cbfs_session_close(struct cbfs_session *session);
+
+/*
+ * Starts reading parts of an image that is going to be opened soon with the
+ * same options.  Only known parts are read, which needs FMAP location from
+ * options or the FMAP cache, and CBFS is covered only by the cache.
+ */
+void cbfs_prefetch(const char *rom_file,
+		   const struct cbfs_open_options *options);
+
+/* arena is passed to boot_data_new() */
+struct boot_data *cbfs_load_boot_data(struct cbfs_session *session,
+				      struct arena *arena);
+bool cbfs_store_boot_data(struct cbfs_session *session, struct boot_data *boot);
+
+/*
+ * Boot data serialized once and stored into any number of images.  Boot blob
+ * is bootorder padded to 4096 bytes, map blob is bootorder_map.
+ */
+struct cbfs_blobs;
+
+struct cbfs_blobs *cbfs_blobs_new(struct boot_data *boot);
+/* map_file can be NULL to leave maps of images unchanged */
+struct cbfs_blobs *cbfs_blobs_load(const char *boot_file,
+				   const char *map_file);
+/* Either file can be NULL to skip writing it */
+bool cbfs_blobs_save(const struct cbfs_blobs *blobs,
+		     const char *boot_file,
+		     const char *map_file);
+void cbfs_blobs_free(struct cbfs_blobs *blobs);
+
+bool cbfs_store_blobs(struct cbfs_session *session,
+		      const struct cbfs_blobs *blobs);
 
 #endif // CBFS_H__
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "flash_layout.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "third-party/fmap.h"
+
+/* Changed erase blocks that follow each other */
+struct layout_range
+{
+	size_t start;
+	size_t end;
+	const struct fmap_area *area;
+	/* Position among ranges in the same area, 0 if it's the only one */
+	int number;
+};
+
+/* Smallest area that contains the whole range or NULL */
+static const struct fmap_area *innermost_area(const struct fmap *fmap,
+					      size_t start,
+					      size_t end)
+{
+	const struct fmap_area *best = NULL;
+	int i;
+
+	for (i = 0; i < fmap->nareas; ++i) {
+		const struct fmap_area *area = &fmap->areas[i];
+		if (area->offset > start ||
+		    (size_t)area->offset + area->size < end)
+			continue;
+		if (best == NULL || area->size < best->size)
+			best = area;
+	}
+
+	return best;
+}
+
+/* Numbers ranges which fall into the same area to keep names unique */
+static void number_ranges(struct layout_range *ranges, int count)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < count; ++i) {
+		int seen = 0;
+		bool shared = false;
+
+		for (j = 0; j < count; ++j) {
+			if (ranges[j].area != ranges[i].area)
+				continue;
+			if (j < i)
+				++seen;
+			if (j != i)
+				shared = true;
+		}
+
+		ranges[i].number = (shared ? seen + 1 : 0);
+	}
+}
+
+static void print_name(FILE *file, const struct layout_range *range)
+{
+	if (range->area == NULL)
+		fprintf(file, "changed");
+	else
+		fprintf(file, "%.*s", FMAP_STRLEN, (const char *)range->area->name);
+
+	if (range->number != 0)
+		fprintf(file, "_%d", range->number);
+}
+
+bool flash_layout_write(const char *layout_file,
+			const partitioned_file_t *pf,
+			size_t block_size)
+{
+	const struct fmap *fmap = partitioned_file_get_fmap(pf);
+	VECTOR(struct layout_range) ranges = { 0 };
+	size_t *blocks;
+	long count;
+	long i;
+	int j;
+	FILE *file;
+	bool success;
+
+	count = partitioned_file_changed_blocks(pf, block_size, &blocks);
+	if (count < 0)
+		return false;
+
+	for (i = 0; i < count; ++i) {
+		struct layout_range *range;
+
+		if (ranges.count != 0 &&
+		    ranges.data[ranges.count - 1].end == blocks[i]) {
+			ranges.data[ranges.count - 1].end += block_size;
+			continue;
+		}
+
+		range = VECTOR_GROW(ranges);
+		if (range == NULL) {
+			fprintf(stderr, "Failed to allocate layout range\n");
+			free(blocks);
+			VECTOR_FREE(ranges);
+			return false;
+		}
+
+		range->start = blocks[i];
+		range->end = blocks[i] + block_size;
+		++ranges.count;
+	}
+	free(blocks);
+
+	for (j = 0; j < ranges.count; ++j) {
+		struct layout_range *range = &ranges.data[j];
+		range->area = innermost_area(fmap, range->start, range->end);
+	}
+	number_ranges(ranges.data, ranges.count);
+
+	file = fopen(layout_file, "w");
+	if (file == NULL) {
+		perror(layout_file);
+		VECTOR_FREE(ranges);
+		return false;
+	}
+
+	for (j = 0; j < ranges.count; ++j) {
+		const struct layout_range *range = &ranges.data[j];
+		fprintf(file, "%08zx:%08zx ", range->start, range->end - 1);
+		print_name(file, range);
+		fprintf(file, "\n");
+	}
+
+	success = (fclose(file) == 0);
+	if (!success) {
+		perror(layout_file);
+	} else if (ranges.count == 0) {
+		fprintf(stderr, "No erase blocks changed, nothing to flash\n");
+	} else {
+		for (j = 0; j < ranges.count; ++j) {
+			printf("%s-i ", (j == 0 ? "" : " "));
+			print_name(stdout, &ranges.data[j]);
+		}
+		printf("\n");
+	}
+
+	VECTOR_FREE(ranges);
+	return success;
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef FLASH_LAYOUT_H__
+#define FLASH_LAYOUT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "third-party/partitioned_file.h"
+
+/*
+ * Writes flashrom layout file that lists only those parts of the image which
+ * pending changes of the partitioned file modify.  Ranges are extended to
+ * erase block boundaries and named after the innermost FMAP area that holds
+ * them.  Matching include arguments ("-i NAME ...") are printed to stdout.
+ */
+bool flash_layout_write(const char *layout_file,
+			const partitioned_file_t *pf,
+			size_t block_size);
+
+#endif // FLASH_LAYOUT_H__
@@ -0,0 +1,193 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "fmap_cache.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "third-party/fmap.h"
+
+#define CACHE_SUFFIX  ".fmap-cache"
+#define CACHE_MAGIC   "CBOFMAP2"
+
+struct cache_header
+{
+	char magic[8];
+
+	/* Key */
+	uint64_t size;
+	uint64_t inode;
+	uint64_t device;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+
+	/* Value, followed by FMAP data and CBFS ranges */
+	int64_t fmap_offset;
+	uint32_t fmap_size;
+	uint32_t range_count;
+};
+
+static void fill_key(struct cache_header *header, const struct stat *st)
+{
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	header->size = st->st_size;
+	header->inode = st->st_ino;
+	header->device = st->st_dev;
+	header->mtime_sec = st->st_mtim.tv_sec;
+	header->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static bool same_key(const struct cache_header *a, const struct cache_header *b)
+{
+	return memcmp(a->magic, b->magic, sizeof(a->magic)) == 0 &&
+	       a->size == b->size &&
+	       a->inode == b->inode &&
+	       a->device == b->device &&
+	       a->mtime_sec == b->mtime_sec &&
+	       a->mtime_nsec == b->mtime_nsec;
+}
+
+bool fmap_cache_lookup(const char *rom_file, struct fmap_cache_entry *entry)
+{
+	struct stat st;
+	struct cache_header expected;
+	struct cache_header header;
+	struct fmap *data = NULL;
+	struct fmap_cache_range *ranges = NULL;
+	char *path;
+	FILE *file;
+	bool hit = false;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->fmap_offset = -1;
+
+	if (stat(rom_file, &st) != 0)
+		return false;
+
+	path = format_str("%s%s", rom_file, CACHE_SUFFIX);
+	if (path == NULL)
+		return false;
+
+	file = fopen(path, "rb");
+	free(path);
+	if (file == NULL)
+		return false;
+
+	fill_key(&expected, &st);
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    !same_key(&header, &expected) ||
+	    header.fmap_size < sizeof(*data) ||
+	    (uint64_t)header.fmap_offset + header.fmap_size > header.size ||
+	    header.range_count > header.size / sizeof(*ranges))
+		goto done;
+
+	data = malloc(header.fmap_size);
+	if (data == NULL || fread(data, header.fmap_size, 1, file) != 1 ||
+	    fmap_size(data) != (int)header.fmap_size)
+		goto done;
+
+	/* One extra to have an allocation even without ranges */
+	ranges = calloc(header.range_count + 1, sizeof(*ranges));
+	if (ranges == NULL ||
+	    fread(ranges, sizeof(*ranges), header.range_count,
+		  file) != header.range_count)
+		goto done;
+
+	entry->fmap_offset = header.fmap_offset;
+	entry->fmap = data;
+	entry->ranges = ranges;
+	entry->range_count = header.range_count;
+	data = NULL;
+	ranges = NULL;
+	hit = true;
+
+done:
+	free(data);
+	free(ranges);
+	(void)fclose(file);
+	return hit;
+}
+
+void fmap_cache_entry_free(struct fmap_cache_entry *entry)
+{
+	free(entry->fmap);
+	free(entry->ranges);
+	entry->fmap = NULL;
+	entry->ranges = NULL;
+	entry->range_count = 0;
+}
+
+bool fmap_cache_store(const char *rom_file,
+		      const struct fmap_cache_entry *entry)
+{
+	struct stat st;
+	struct cache_header header;
+	char *path = NULL;
+	char *temp_path = NULL;
+	FILE *file = NULL;
+	int fd = -1;
+	bool success = false;
+
+	if (stat(rom_file, &st) != 0)
+		goto done;
+
+	fill_key(&header, &st);
+	header.fmap_offset = entry->fmap_offset;
+	header.fmap_size = fmap_size(entry->fmap);
+	header.range_count = entry->range_count;
+
+	path = format_str("%s%s", rom_file, CACHE_SUFFIX);
+	temp_path = format_str("%s%s.XXXXXX", rom_file, CACHE_SUFFIX);
+	if (path == NULL || temp_path == NULL)
+		goto done;
+
+	/* Write a new file and rename it to never expose partial data */
+	fd = mkstemp(temp_path);
+	if (fd == -1)
+		goto done;
+
+	file = fdopen(fd, "wb");
+	if (file == NULL)
+		goto done;
+	fd = -1;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    fwrite(entry->fmap, header.fmap_size, 1, file) != 1 ||
+	    fwrite(entry->ranges, sizeof(*entry->ranges), header.range_count,
+		   file) != header.range_count)
+		goto done;
+
+	if (fclose(file) != 0) {
+		file = NULL;
+		goto done;
+	}
+	file = NULL;
+
+	success = (rename(temp_path, path) == 0);
+
+done:
+	if (!success)
+		fprintf(stderr, "Failed to update FMAP cache of %s: %s\n",
+			rom_file, strerror(errno));
+
+	if (file != NULL)
+		(void)fclose(file);
+	if (fd != -1)
+		(void)close(fd);
+	if (!success && temp_path != NULL)
+		(void)unlink(temp_path);
+
+	free(path);
+	free(temp_path);
+	return success;
+}
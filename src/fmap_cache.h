@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef FMAP_CACHE_H__
+#define FMAP_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct fmap;
+
+/*
+ * Sidecar file next to a ROM image which remembers offset of FMAP and its area
+ * table, so that repeated runs don't need to search for it.  It also remembers
+ * which parts of CBFS loading boot data reads, so that they can be prefetched.
+ * Cache is keyed by size, modification time and inode of the image.
+ */
+
+/* Part of an image, offset is from its beginning */
+struct fmap_cache_range
+{
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct fmap_cache_entry
+{
+	long fmap_offset;
+	struct fmap *fmap;
+	struct fmap_cache_range *ranges;
+	uint32_t range_count;
+};
+
+/*
+ * Returns false on cache miss.  On hit, entry is filled with copies of
+ * recorded data which should be freed with fmap_cache_entry_free().
+ */
+bool fmap_cache_lookup(const char *rom_file, struct fmap_cache_entry *entry);
+void fmap_cache_entry_free(struct fmap_cache_entry *entry);
+
+/* Records FMAP location and CBFS ranges for the current state of the image */
+bool fmap_cache_store(const char *rom_file,
+		      const struct fmap_cache_entry *entry);
+
+#endif // FMAP_CACHE_H__
@@ -2,8 +2,13 @@
 
 #include <curses.h>
 
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <getopt.h>
 #include <unistd.h>
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,25 +16,98 @@
 #include "app.h"
 #include "boot_data.h"
 #include "cbfs.h"
+#include "manifest.h"
 #include "ui_main.h"
 #include "utils.h"
+#include "worker_pool.h"
+
+/* Files of a directory which are processed when it's given instead of ROM */
+#define ROM_SUFFIX ".rom"
 
 struct args
 {
-	const char *rom_file;
+	VECTOR(const char *) rom_files;
+	/* Number of images processed in parallel */
+	int jobs;
 	const char *boot_order;
-	const char **boot_options;
-	int boot_option_count;
+	VECTOR(const char *) boot_options;
 	bool interactive;
+	/* Where to write serialized boot data instead of updating the image */
+	const char *dump_boot;
+	const char *dump_map;
+	/* Serialized boot data to store into every image */
+	const char *inject_boot;
+	const char *inject_map;
+	/* List of images with edits for each of them */
+	const char *manifest;
+	struct cbfs_open_options open_options;
+};
+
+enum
+{
+	LONG_OPT_FMAP_OFFSET = 0x100,
+	LONG_OPT_FMAP_CACHE,
+	LONG_OPT_COUNT_HEADERS,
+	LONG_OPT_REPORT_BLOCKS,
+	LONG_OPT_LAYOUT,
+	LONG_OPT_PARTIAL,
+	LONG_OPT_FMAP,
+	LONG_OPT_DUMP_BOOT,
+	LONG_OPT_DUMP_MAP,
+	LONG_OPT_INJECT_BOOT,
+	LONG_OPT_INJECT_MAP,
+	LONG_OPT_MANIFEST,
+	LONG_OPT_ATOMIC,
+};
+
+static const struct option LONG_OPTIONS[] =
+{
+	{ "fmap-offset", required_argument, NULL, LONG_OPT_FMAP_OFFSET },
+	{ "fmap-cache", no_argument, NULL, LONG_OPT_FMAP_CACHE },
+	{ "count-headers", no_argument, NULL, LONG_OPT_COUNT_HEADERS },
+	{ "report-blocks", no_argument, NULL, LONG_OPT_REPORT_BLOCKS },
+	{ "layout", required_argument, NULL, LONG_OPT_LAYOUT },
+	{ "partial", no_argument, NULL, LONG_OPT_PARTIAL },
+	{ "fmap", required_argument, NULL, LONG_OPT_FMAP },
+	{ "dump-boot", required_argument, NULL, LONG_OPT_DUMP_BOOT },
+	{ "dump-map", required_argument, NULL, LONG_OPT_DUMP_MAP },
+	{ "inject-boot", required_argument, NULL, LONG_OPT_INJECT_BOOT },
+	{ "inject-map", required_argument, NULL, LONG_OPT_INJECT_MAP },
+	{ "manifest", required_argument, NULL, LONG_OPT_MANIFEST },
+	{ "atomic", no_argument, NULL, LONG_OPT_ATOMIC },
+	{ "output", required_argument, NULL, 'O' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 },
 };
 
 static const char *USAGE_FMT = "Usage: %s [-b boot-source,...] "
 					 "[-o option=value] "
+					 "[-j jobs] "
+					 "[-O out.rom] "
+					 "[--fmap-offset offset] "
+					 "[--fmap-cache] "
+					 "[--count-headers] "
+					 "[--report-blocks] "
+					 "[--layout file] "
+					 "[--partial] "
+					 "[--fmap file] "
+					 "[--atomic] "
+					 "[--dump-boot file] "
+					 "[--dump-map file] "
 					 "[-h] "
 					 "[-v] "
-					 "coreboot.rom\n";
-
-static bool run_ui(const struct args *args, struct boot_data *boot)
+					 "coreboot.rom...\n"
+					 "       %s --inject-boot file "
+					 "[--inject-map file] "
+					 "[options] "
+					 "coreboot.rom...\n"
+					 "       %s --manifest file "
+					 "[options]\n";
+
+static bool run_ui(const struct args *args,
+		   struct cbfs_session *session,
+		   struct boot_data *boot)
 {
 	WINDOW *window;
 	bool save;
@@ -41,7 +119,7 @@ static bool run_ui(const struct args *args, struct boot_data *boot)
 	window = newwin(getmaxy(stdscr), getmaxx(stdscr), 0, 0);
 	keypad(window, true);
 
-	main_run(window, boot, args->rom_file, &save);
+	main_run(window, boot, args->rom_files.data[0], &save);
 
 	delwin(window);
 
@@ -49,45 +127,62 @@ static bool run_ui(const struct args *args, struct boot_data *boot)
 
 	/* Saving is performed after UI is turned off */
 	if (save)
-		return cbfs_store_boot_data(boot, args->rom_file);
+		return cbfs_store_boot_data(session, boot);
 
 	return true;
 }
 
-static bool batch_reorder(const struct args *args, struct boot_data *boot)
+/* Finds record whose name starts the list, device paths can contain commas */
+static int match_record(const struct boot_data *boot, const char *list,
+			size_t *len)
+{
+	int i;
+	int found = -1;
+
+	*len = 0;
+	for (i = 0; i < boot->record_count; ++i) {
+		const struct str_view name = boot->records[i].name;
+
+		if (name.len <= *len)
+			continue;
+		if (strncmp(list, name.data, name.len) != 0)
+			continue;
+		if (list[name.len] != ',' && list[name.len] != '\0')
+			continue;
+
+		found = i;
+		*len = name.len;
+	}
+
+	return found;
+}
+
+static bool batch_reorder(const char *boot_order, struct boot_data *boot)
 {
 	int target = 0;
-	char *ptr;
-	const char *token;
-	char *boot_order;
+	const char *list = boot_order;
 
-	if (args->boot_order == NULL)
+	if (list == NULL)
 		return true;
 
-	boot_order = strdup(args->boot_order);
+	while (*(list += strspn(list, ",")) != '\0') {
+		size_t len;
+		const int i = match_record(boot, list, &len);
 
-	for (ptr = boot_order; (token = strtok(ptr, ",")) != NULL; ptr = NULL) {
-		int i;
-		for (i = 0; i < boot->record_count; ++i) {
-			if (strcmp(boot->records[i].name, token) == 0) {
-				boot_data_move(boot, i, target++);
-				break;
-			}
+		if (i < 0) {
+			fprintf(stderr, "Unrecognized boot record name: %.*s\n",
+				(int)strcspn(list, ","), list);
+			return false;
 		}
 
-		if (i == boot->record_count) {
-			fprintf(stderr, "Unrecognized boot record name: %s\n",
-				token);
-			break;
-		}
+		boot_data_move(boot, i, target++);
+		list += len;
 	}
 
-	free(boot_order);
-
-	return (token == NULL);
+	return true;
 }
 
-static bool set_option(struct option *option, const char *str_value)
+static bool set_option(struct boot_option *option, const char *str_value)
 {
 	int int_value = 0;
 	const struct option_def *option_def = &OPTIONS[option->id];
@@ -117,21 +212,23 @@ static bool set_option(struct option *option, const char *str_value)
 	return boot_data_set_option(option, int_value);
 }
 
-static bool batch_set_options(const struct args *args, struct boot_data *boot)
+static bool batch_set_options(const char *const *settings,
+			      int count,
+			      struct boot_data *boot)
 {
 	int i;
 
-	for (i = 0; i < args->boot_option_count; ++i) {
+	for (i = 0; i < count; ++i) {
 		int n;
 		int j;
 
 		char name[64];
 		char value[64];
 
-		n = sscanf(args->boot_options[i], "%63[^=]=%63s", name, value);
+		n = sscanf(settings[i], "%63[^=]=%63s", name, value);
 		if (n != 2) {
 			fprintf(stderr, "Unrecognized option setting: %s\n",
-				args->boot_options[i]);
+				settings[i]);
 			break;
 		}
 
@@ -156,24 +253,283 @@ static bool batch_set_options(const struct args *args, struct boot_data *boot)
 
 	}
 
-	return (i == args->boot_option_count);
+	return (i == count);
+}
+
+static bool dump_blobs(const struct args *args, struct boot_data *boot)
+{
+	bool success;
+	struct cbfs_blobs *blobs = cbfs_blobs_new(boot);
+
+	if (blobs == NULL)
+		return false;
+
+	success = cbfs_blobs_save(blobs, args->dump_boot, args->dump_map);
+	cbfs_blobs_free(blobs);
+	return success;
+}
+
+static bool run_batch(const struct args *args,
+		      struct cbfs_session *session,
+		      struct boot_data *boot)
+{
+	if (!batch_reorder(args->boot_order, boot) ||
+	    !batch_set_options(args->boot_options.data,
+			       args->boot_options.count, boot))
+		return false;
+
+	if (args->dump_boot != NULL || args->dump_map != NULL)
+		return dump_blobs(args, boot);
+
+	return cbfs_store_boot_data(session, boot);
+}
+
+/* Images each worker keeps being prefetched ahead of the one it processes */
+#define PREFETCH_DEPTH 4
+
+typedef const char *(*rom_file_fn)(const void *ctx, int item);
+
+/*
+ * Workers take items in order, so item + k*jobs comes after items of other
+ * workers.  Items of the first round start prefetches of several rounds and
+ * later items add one more round.  This way every image is prefetched once
+ * and each worker has requests of PREFETCH_DEPTH images in flight.
+ */
+static void prefetch_ahead(const struct args *args, int item, int count,
+			   rom_file_fn rom_file, const void *ctx)
+{
+	int round = (item < args->jobs ? 1 : PREFETCH_DEPTH);
+
+	for (; round <= PREFETCH_DEPTH; ++round) {
+		const int next = item + round*args->jobs;
+
+		if (next >= count)
+			break;
+		cbfs_prefetch(rom_file(ctx, next), &args->open_options);
+	}
+}
+
+static const char *arg_rom_file(const void *ctx, int item)
+{
+	const struct args *args = ctx;
+	return args->rom_files.data[item];
+}
+
+/* Loads, edits and stores one image, called from worker threads */
+static bool process_rom(void *ctx, struct arena *arena, int item)
+{
+	const struct args *args = ctx;
+	const char *rom_file = args->rom_files.data[item];
+	struct cbfs_session *session;
+	struct boot_data *boot;
+	bool success = false;
+
+	prefetch_ahead(args, item, args->rom_files.count, &arg_rom_file, args);
+
+	session = cbfs_session_open(rom_file, &args->open_options);
+	if (session == NULL)
+		return false;
+
+	boot = cbfs_load_boot_data(session, arena);
+	if (boot == NULL) {
+		fprintf(stderr, "Failed to read boot data: %s\n", rom_file);
+	} else {
+		success = run_batch(args, session, boot);
+		boot_data_free(boot);
+	}
+
+	cbfs_session_close(session);
+	return success;
+}
+
+struct inject_ctx
+{
+	const struct args *args;
+	const struct cbfs_blobs *blobs;
+};
+
+static bool inject_rom(void *ctx, struct arena *arena, int item)
+{
+	const struct inject_ctx *inject = ctx;
+	const struct args *args = inject->args;
+	const char *rom_file = args->rom_files.data[item];
+	struct cbfs_session *session;
+	bool success;
+
+	(void)arena;
+
+	prefetch_ahead(args, item, args->rom_files.count, &arg_rom_file, args);
+
+	session = cbfs_session_open(rom_file, &args->open_options);
+	success = (session != NULL && cbfs_store_blobs(session, inject->blobs));
+	if (!success)
+		fprintf(stderr, "Failed to update %s\n", rom_file);
+
+	cbfs_session_close(session);
+	return success;
+}
+
+/* Stores the same serialized boot data into every image */
+static bool run_inject(const struct args *args)
+{
+	bool success;
+	struct inject_ctx inject = { .args = args };
+	struct cbfs_blobs *blobs;
+
+	blobs = cbfs_blobs_load(args->inject_boot, args->inject_map);
+	if (blobs == NULL)
+		return false;
+
+	inject.blobs = blobs;
+	success = worker_pool_run(args->jobs, args->rom_files.count,
+				  &inject_rom, &inject);
+
+	cbfs_blobs_free(blobs);
+	return success;
+}
+
+struct manifest_ctx
+{
+	const struct args *args;
+	const struct manifest *manifest;
+	/* Outcome for every entry of the manifest */
+	bool *updated;
+};
+
+static const char *manifest_rom_file(const void *ctx, int item)
+{
+	const struct manifest *manifest = ctx;
+	return manifest->entries.data[item].rom_file;
+}
+
+/* Edits one image as its manifest entry says, called from worker threads */
+static bool manifest_rom(void *ctx, struct arena *arena, int item)
+{
+	struct manifest_ctx *fleet = ctx;
+	const struct manifest *manifest = fleet->manifest;
+	const struct manifest_entry *entry = &manifest->entries.data[item];
+	struct cbfs_session *session;
+	struct boot_data *boot;
+	bool success = false;
+
+	prefetch_ahead(fleet->args, item, manifest->entries.count,
+		       &manifest_rom_file, manifest);
+
+	session = cbfs_session_open(entry->rom_file,
+				    &fleet->args->open_options);
+	if (session == NULL)
+		goto done;
+
+	boot = cbfs_load_boot_data(session, arena);
+	if (boot == NULL) {
+		fprintf(stderr, "Failed to read boot data: %s\n",
+			entry->rom_file);
+	} else {
+		success = batch_reorder(entry->boot_order, boot) &&
+			  batch_set_options(
+				&manifest->options.data[entry->first_option],
+				entry->option_count, boot) &&
+			  cbfs_store_boot_data(session, boot);
+		boot_data_free(boot);
+	}
+
+	cbfs_session_close(session);
+
+done:
+	fleet->updated[item] = success;
+	return success;
 }
 
-static bool run_batch(const struct args *args, struct boot_data *boot)
+/* Applies per-image edits of a manifest and reports how each image fared */
+static bool run_manifest(const struct args *args)
 {
-	return batch_reorder(args, boot) &&
-	       batch_set_options(args, boot) &&
-	       cbfs_store_boot_data(boot, args->rom_file);
+	struct manifest manifest;
+	struct manifest_ctx fleet = { .args = args, .manifest = &manifest };
+	int updated_count = 0;
+	bool success;
+	int i;
+
+	if (!manifest_load(&manifest, args->manifest))
+		return false;
+
+	/* Images of a manifest are processed in parallel and report to stdout */
+	for (i = 0; i < manifest.entries.count; ++i) {
+		if (strcmp(manifest.entries.data[i].rom_file,
+			   CBFS_STDIO_FILE) == 0) {
+			fprintf(stderr, "Manifest %s can't use image on stdin\n",
+				args->manifest);
+			manifest_free(&manifest);
+			return false;
+		}
+	}
+
+	/* One extra to have an allocation even for an empty manifest */
+	fleet.updated = calloc(manifest.entries.count + 1,
+			       sizeof(*fleet.updated));
+	if (fleet.updated == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		manifest_free(&manifest);
+		return false;
+	}
+
+	success = worker_pool_run(args->jobs, manifest.entries.count,
+				  &manifest_rom, &fleet);
+
+	for (i = 0; i < manifest.entries.count; ++i) {
+		printf("%-7s %s\n", fleet.updated[i] ? "updated" : "failed",
+		       manifest.entries.data[i].rom_file);
+		updated_count += fleet.updated[i];
+	}
+	printf("Updated %d of %d images\n", updated_count,
+	       manifest.entries.count);
+
+	free(fleet.updated);
+	manifest_free(&manifest);
+	return success;
 }
 
 static void print_help(const char *command)
 {
 	size_t i;
 
-	printf(USAGE_FMT, command);
+	printf(USAGE_FMT, command, command, command);
 
 	printf("\n");
 	printf("boot-source is a value from a boot order list.\n");
+	printf("Directories are replaced with their *%s files.\n", ROM_SUFFIX);
+	printf("\n");
+	printf("-O, --output   save to this file and leave the input "
+	       "unchanged\n");
+	printf("-j             number of images to process in parallel, "
+	       "all CPUs by default\n");
+	printf("--fmap-offset  check this offset for FMAP before searching "
+	       "the image\n");
+	printf("--fmap-cache   remember where FMAP is in <rom>.fmap-cache\n");
+	printf("--count-headers\n");
+	printf("               warn if a legacy image has several CBFS master "
+	       "headers\n");
+	printf("--report-blocks\n");
+	printf("               list 4 KiB erase blocks changed by saving\n");
+	printf("--layout       write flashrom layout of blocks changed by saving "
+	       "and print\n");
+	printf("               its -i arguments\n");
+	printf("--partial      edit a dump of only FMAP and BOOTORDER regions, "
+	       "boot\n");
+	printf("               sources are named by their device paths\n");
+	printf("--fmap         take FMAP from this file instead of the image\n");
+	printf("--atomic       save into a copy of the image and rename it "
+	       "over the\n");
+	printf("               original, so that it's never half-written\n");
+	printf("--dump-boot    write padded bootorder to a file instead of "
+	       "saving\n");
+	printf("--dump-map     write bootorder_map to a file instead of "
+	       "saving\n");
+	printf("--inject-boot  store bootorder from --dump-boot output into "
+	       "images\n");
+	printf("--inject-map   store bootorder_map from --dump-map output "
+	       "into images\n");
+	printf("--manifest     edit images listed in a file, each line is:\n");
+	printf("               path [boot-source,...] [option=value]...\n");
 	printf("\n");
 	printf("Recognized options and possible values:\n");
 
@@ -196,14 +552,104 @@ static void print_help(const char *command)
 	}
 }
 
+static int is_rom_entry(const struct dirent *entry)
+{
+	const size_t len = strlen(entry->d_name);
+	const size_t suffix_len = strlen(ROM_SUFFIX);
+
+	return entry->d_name[0] != '.' && len > suffix_len &&
+	       strcmp(entry->d_name + len - suffix_len, ROM_SUFFIX) == 0;
+}
+
+static void add_rom_file(struct args *args, const char *rom_file)
+{
+	const char **slot = VECTOR_GROW(args->rom_files);
+	if (slot == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	*slot = rom_file;
+	++args->rom_files.count;
+}
+
+/* Adds either the file or images of the directory in sorted order */
+static void add_rom_path(struct args *args, const char *path)
+{
+	struct stat st;
+	struct dirent **entries;
+	int count;
+	int i;
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		add_rom_file(args, path);
+		return;
+	}
+
+	count = scandir(path, &entries, &is_rom_entry, &alphasort);
+	if (count < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Paths are kept for the whole run */
+	for (i = 0; i < count; ++i) {
+		char *rom_file = format_str("%s/%s", path, entries[i]->d_name);
+		if (rom_file == NULL) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		add_rom_file(args, rom_file);
+		free(entries[i]);
+	}
+
+	free(entries);
+}
+
+/* Image goes through stdout, so nothing else can be printed there */
+static void check_stream_args(const struct args *args)
+{
+	const struct cbfs_open_options *options = &args->open_options;
+	const char *conflict = NULL;
+
+	if (args->rom_files.count > 1)
+		conflict = "other images";
+	else if (args->interactive)
+		conflict = "interactive mode";
+	else if (options->report_blocks)
+		conflict = "--report-blocks";
+	else if (options->layout_file != NULL)
+		conflict = "--layout";
+	else if (options->output_file != NULL)
+		conflict = "--output";
+	else if (options->atomic)
+		conflict = "--atomic";
+	else if (options->fmap_cache)
+		conflict = "--fmap-cache";
+
+	if (conflict != NULL) {
+		fprintf(stderr, "Image on stdin can't be combined with %s\n",
+			conflict);
+		exit(EXIT_FAILURE);
+	}
+}
+
 static const struct args *parse_args(int argc, char **argv)
 {
 	static struct args args;
 
 	int i;
 	int opt;
+	char *end;
+
+	args.open_options.fmap_offset = -1;
+	args.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (args.jobs < 1)
+		args.jobs = 1;
 
-	while ((opt = getopt(argc, argv, "hvb:o:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "hvb:o:j:O:", LONG_OPTIONS,
+				  NULL)) != -1) {
 		switch (opt) {
 			const char **option;
 
@@ -218,62 +664,194 @@ static const struct args *parse_args(int argc, char **argv)
 					APP_NAME, APP_VERSION);
 				exit(EXIT_SUCCESS);
 			case 'o':
-				option = GROW_ARRAY(args.boot_options,
-						    args.boot_option_count);
+				option = VECTOR_GROW(args.boot_options);
 				if (option != NULL) {
 					*option = optarg;
-					++args.boot_option_count;
+					++args.boot_options.count;
 				}
 				break;
+			case 'j':
+				errno = 0;
+				args.jobs = strtol(optarg, &end, 10);
+				if (errno != 0 || *end != '\0' ||
+				    args.jobs < 1) {
+					fprintf(stderr,
+						"Invalid number of jobs: %s\n",
+						optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case LONG_OPT_FMAP_OFFSET:
+				errno = 0;
+				args.open_options.fmap_offset =
+					strtol(optarg, &end, 0);
+				if (errno != 0 || *end != '\0' ||
+				    args.open_options.fmap_offset < 0) {
+					fprintf(stderr,
+						"Invalid FMAP offset: %s\n",
+						optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case LONG_OPT_FMAP_CACHE:
+				args.open_options.fmap_cache = true;
+				break;
+			case LONG_OPT_COUNT_HEADERS:
+				args.open_options.count_headers = true;
+				break;
+			case LONG_OPT_REPORT_BLOCKS:
+				args.open_options.report_blocks = true;
+				break;
+			case LONG_OPT_LAYOUT:
+				args.open_options.layout_file = optarg;
+				break;
+			case LONG_OPT_PARTIAL:
+				args.open_options.partial = true;
+				break;
+			case LONG_OPT_FMAP:
+				args.open_options.fmap_file = optarg;
+				break;
+			case LONG_OPT_DUMP_BOOT:
+				args.dump_boot = optarg;
+				break;
+			case LONG_OPT_DUMP_MAP:
+				args.dump_map = optarg;
+				break;
+			case LONG_OPT_INJECT_BOOT:
+				args.inject_boot = optarg;
+				break;
+			case LONG_OPT_INJECT_MAP:
+				args.inject_map = optarg;
+				break;
+			case LONG_OPT_MANIFEST:
+				args.manifest = optarg;
+				break;
+			case LONG_OPT_ATOMIC:
+				args.open_options.atomic = true;
+				break;
+			case 'O':
+				args.open_options.output_file = optarg;
+				break;
 
 			case '?': /* parsing error */
-				fprintf(stderr, USAGE_FMT, argv[0]);
+				fprintf(stderr, USAGE_FMT, argv[0], argv[0], argv[0]);
 				exit(EXIT_FAILURE);
 		}
 	}
 
+	/* Options are kept for the whole run */
+	VECTOR_SHRINK_TO_FIT(args.boot_options);
+
 	/* positional arguments */
-	for (i = optind; argv[i] != NULL; ++i) {
-		if (args.rom_file != NULL) {
-			fprintf(stderr, "Excessive positional argument: %s\n",
-				argv[i]);
+	for (i = optind; argv[i] != NULL; ++i)
+		add_rom_path(&args, argv[i]);
+
+	if (args.manifest != NULL) {
+		if (args.rom_files.count != 0 || args.boot_order != NULL ||
+		    args.boot_options.count != 0 || args.dump_boot != NULL ||
+		    args.dump_map != NULL || args.inject_boot != NULL ||
+		    args.open_options.layout_file != NULL ||
+		    args.open_options.output_file != NULL) {
+			fprintf(stderr, "Manifest already lists images and "
+				"their edits\n");
 			exit(EXIT_FAILURE);
 		}
 
-		args.rom_file = argv[i];
+		args.open_options.write_access = true;
+		return &args;
 	}
 
-	if (args.rom_file == NULL) {
+	if (args.rom_files.count == 0) {
 		fprintf(stderr, "ROM-file is missing from command line\n");
-		fprintf(stderr, USAGE_FMT, argv[0]);
+		fprintf(stderr, USAGE_FMT, argv[0], argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (args.inject_boot == NULL && args.inject_map != NULL) {
+		fprintf(stderr, "--inject-map requires --inject-boot\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args.inject_boot != NULL &&
+	    (args.boot_order != NULL || args.boot_options.count != 0 ||
+	     args.dump_boot != NULL || args.dump_map != NULL)) {
+		fprintf(stderr, "Injected boot data can't be changed or "
+			"dumped\n");
 		exit(EXIT_FAILURE);
 	}
 
 	args.interactive = (args.boot_order == NULL) &&
-			   (args.boot_option_count == 0);
+			   (args.boot_options.count == 0) &&
+			   (args.dump_boot == NULL) &&
+			   (args.dump_map == NULL) &&
+			   (args.inject_boot == NULL);
+
+	/* These produce a single result */
+	if (args.rom_files.count > 1 &&
+	    (args.interactive || args.dump_boot != NULL ||
+	     args.dump_map != NULL ||
+	     args.open_options.layout_file != NULL ||
+	     args.open_options.output_file != NULL)) {
+		fprintf(stderr, "Excessive positional argument: %s\n",
+			args.rom_files.data[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < args.rom_files.count; ++i) {
+		if (strcmp(args.rom_files.data[i], CBFS_STDIO_FILE) == 0)
+			check_stream_args(&args);
+	}
+
+	/* Read-only images can still be browsed interactively, dumping boot
+	 * data doesn't change the image */
+	if (args.dump_boot != NULL || args.dump_map != NULL)
+		args.open_options.write_access = false;
+	else if (args.open_options.output_file != NULL)
+		args.open_options.write_access = true;
+	else
+		args.open_options.write_access =
+			!args.interactive ||
+			access(args.rom_files.data[0], W_OK) == 0;
 
 	return &args;
 }
 
 int main(int argc, char **argv)
 {
+	struct cbfs_session *session;
 	struct boot_data *boot;
 	bool success;
 
 	const struct args *args = parse_args(argc, argv);
 
-	boot = cbfs_load_boot_data(args->rom_file);
+	if (args->manifest != NULL)
+		return (run_manifest(args) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if (args->inject_boot != NULL)
+		return (run_inject(args) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if (!args->interactive) {
+		success = worker_pool_run(args->jobs, args->rom_files.count,
+					  &process_rom, (void *)args);
+		return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	session = cbfs_session_open(args->rom_files.data[0],
+				    &args->open_options);
+	if (session == NULL)
+		return EXIT_FAILURE;
+
+	boot = cbfs_load_boot_data(session, /*arena=*/NULL);
 	if (boot == NULL) {
 		fprintf(stderr, "Failed to read boot data\n");
+		cbfs_session_close(session);
 		return EXIT_FAILURE;
 	}
 
-	if (args->interactive)
-		success = run_ui(args, boot);
-	else
-		success = run_batch(args, boot);
+	success = run_ui(args, session, boot);
 
 	boot_data_free(boot);
+	cbfs_session_close(session);
 
 	return (success ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "manifest.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WHITESPACE " \t\r"
+
+/* Reads the whole file into a NUL-terminated string */
+static char *read_text(const char *path)
+{
+	FILE *file;
+	char *text = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	do {
+		if (size + 1 >= capacity) {
+			char *grown;
+
+			capacity = (capacity == 0 ? 4096 : 2*capacity);
+			grown = realloc(text, capacity);
+			if (grown == NULL) {
+				fprintf(stderr, "Failed to allocate memory\n");
+				goto failure;
+			}
+			text = grown;
+		}
+
+		size += fread(text + size, 1, capacity - size - 1, file);
+	} while (!feof(file) && !ferror(file));
+
+	if (ferror(file)) {
+		fprintf(stderr, "Failed to read %s\n", path);
+		goto failure;
+	}
+
+	fclose(file);
+	text[size] = '\0';
+	return text;
+
+failure:
+	fclose(file);
+	free(text);
+	return NULL;
+}
+
+/* Splits off the next whitespace-separated field of a line */
+static char *next_field(char **line)
+{
+	char *field = *line + strspn(*line, WHITESPACE);
+	const size_t len = strcspn(field, WHITESPACE);
+
+	if (len == 0)
+		return NULL;
+
+	*line = field + len;
+	if (**line != '\0')
+		*(*line)++ = '\0';
+	return field;
+}
+
+static bool parse_entry(struct manifest *manifest, char *line, int line_no)
+{
+	struct manifest_entry *entry;
+	char *field;
+
+	entry = VECTOR_GROW(manifest->entries);
+	if (entry == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return false;
+	}
+
+	entry->rom_file = next_field(&line);
+	entry->boot_order = NULL;
+	entry->first_option = manifest->options.count;
+	entry->option_count = 0;
+
+	while ((field = next_field(&line)) != NULL) {
+		const char **option;
+
+		if (strchr(field, '=') == NULL) {
+			if (entry->boot_order != NULL) {
+				fprintf(stderr, "Manifest line %d has more "
+					"than one boot order: %s\n",
+					line_no, field);
+				return false;
+			}
+			entry->boot_order = field;
+			continue;
+		}
+
+		option = VECTOR_GROW(manifest->options);
+		if (option == NULL) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			return false;
+		}
+		*option = field;
+		++manifest->options.count;
+		++entry->option_count;
+	}
+
+	++manifest->entries.count;
+	return true;
+}
+
+bool manifest_load(struct manifest *manifest, const char *path)
+{
+	char *line;
+	int line_no = 0;
+
+	memset(manifest, 0, sizeof(*manifest));
+
+	manifest->text = read_text(path);
+	if (manifest->text == NULL)
+		return false;
+
+	for (line = manifest->text; line != NULL; ) {
+		char *eol = strchr(line, '\n');
+		char *first;
+
+		if (eol != NULL)
+			*eol++ = '\0';
+		++line_no;
+
+		first = line + strspn(line, WHITESPACE);
+		if (*first != '\0' && *first != '#' &&
+		    !parse_entry(manifest, line, line_no)) {
+			manifest_free(manifest);
+			return false;
+		}
+
+		line = eol;
+	}
+
+	return true;
+}
+
+void manifest_free(struct manifest *manifest)
+{
+	VECTOR_FREE(manifest->entries);
+	VECTOR_FREE(manifest->options);
+	free(manifest->text);
+	manifest->text = NULL;
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef MANIFEST_H__
+#define MANIFEST_H__
+
+#include <stdbool.h>
+
+#include "utils.h"
+
+/*
+ * Manifest lists images along with edits to make to each of them, one per
+ * line:
+ *
+ *     path/to/coreboot.rom [boot-source,...] [option=value]...
+ *
+ * Fields are separated by whitespace.  Empty lines and lines starting with
+ * '#' are skipped.
+ */
+
+struct manifest_entry
+{
+	const char *rom_file;
+	/* NULL if boot order isn't changed */
+	const char *boot_order;
+	/* Slice of manifest's option settings */
+	int first_option;
+	int option_count;
+};
+
+struct manifest
+{
+	/* Manifest file, which all strings point into */
+	char *text;
+	VECTOR(struct manifest_entry) entries;
+	/* "option=value" strings of all entries */
+	VECTOR(const char *) options;
+};
+
+bool manifest_load(struct manifest *manifest, const char *path);
+void manifest_free(struct manifest *manifest);
+
+#endif // MANIFEST_H__
@@ -14,7 +14,7 @@
 #include "ui_screen.h"
 #include "utils.h"
 
-static char *format_option_item(struct option *option)
+static char *format_option_item(struct boot_option *option)
 {
 	const struct option_def *option_def = &OPTIONS[option->id];
 
@@ -55,6 +55,7 @@ static void fill_options_screen(struct screen *screen, struct boot_data *boot)
 	int i;
 
 	screen_clear_items(screen);
+	screen_reserve_items(screen, boot->option_count);
 
 	for (i = 0; i < boot->option_count; ++i) {
 		char *item = format_option_item(&boot->options[i]);
@@ -130,7 +131,7 @@ static char *get_number(WINDOW *window,
 	return strdup(input_buf);
 }
 
-static void toggle_option(struct option *option, WINDOW *window)
+static void toggle_option(struct boot_option *option, WINDOW *window)
 {
 	char *title;
 	char *input;
@@ -187,7 +188,7 @@ void options_run(WINDOW *window, struct boot_data *boot)
 		}
 
 		for (i = 0; i < boot->option_count; ++i) {
-			struct option *option = &boot->options[i];
+			struct boot_option *option = &boot->options[i];
 			const int id = option->id;
 			const struct option_def *option_def = &OPTIONS[id];
 
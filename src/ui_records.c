@@ -16,11 +16,13 @@ static void fill_records_screen(struct screen *screen, struct boot_data *boot)
 	int i;
 
 	screen_clear_items(screen);
+	screen_reserve_items(screen, boot->record_count);
 
 	for (i = 0; i < boot->record_count; ++i) {
-		char *item = format_str("(%c)  %s",
+		char *item = format_str("(%c)  %.*s",
 					'A' + i,
-					boot->records[i].name);
+					(int)boot->records[i].name.len,
+					boot->records[i].name.data);
 		screen_add_item(screen, item);
 		free(item);
 	}
@@ -23,11 +23,13 @@ struct screen *screen_new(const char *title)
 		return NULL;
 	}
 
-	screen->item_count = 0;
-	screen->items = NULL;
+	screen->items.data = NULL;
+	screen->items.count = 0;
+	screen->items.capacity = 0;
 
-	screen->hint_count = 0;
-	screen->hints = NULL;
+	screen->hints.data = NULL;
+	screen->hints.count = 0;
+	screen->hints.capacity = 0;
 
 	screen->top = 0;
 	screen->current = 0;
@@ -40,10 +42,11 @@ void screen_free(struct screen *screen)
 	int i;
 
 	screen_clear_items(screen);
+	VECTOR_FREE(screen->items);
 
-	for (i = 0; i < screen->hint_count; ++i)
-		free(screen->hints[i]);
-	free(screen->hints);
+	for (i = 0; i < screen->hints.count; ++i)
+		free(screen->hints.data[i]);
+	VECTOR_FREE(screen->hints);
 
 	free(screen->title);
 	free(screen);
@@ -51,48 +54,51 @@ void screen_free(struct screen *screen)
 
 void screen_add_item(struct screen *screen, const char *item)
 {
-	char **new_item = GROW_ARRAY(screen->items, screen->item_count);
+	char **new_item = VECTOR_GROW(screen->items);
 	if (new_item == NULL)
 		return;
 
 	*new_item = strdup(item);
 	if (*new_item != NULL)
-		++screen->item_count;
+		++screen->items.count;
+}
+
+void screen_reserve_items(struct screen *screen, int count)
+{
+	(void)VECTOR_RESERVE(screen->items, count);
 }
 
 void screen_clear_items(struct screen *screen)
 {
 	int i;
 
-	for (i = 0; i < screen->item_count; ++i)
-		free(screen->items[i]);
-
-	free(screen->items);
+	for (i = 0; i < screen->items.count; ++i)
+		free(screen->items.data[i]);
 
-	screen->items = NULL;
-	screen->item_count = 0;
+	/* Keep capacity, items are usually refilled right away */
+	screen->items.count = 0;
 }
 
 void screen_add_hint(struct screen *screen, const char *hint)
 {
-	char **new_item = GROW_ARRAY(screen->hints, screen->hint_count);
+	char **new_item = VECTOR_GROW(screen->hints);
 	if (new_item == NULL)
 		return;
 
 	*new_item = strdup(hint);
 	if (*new_item != NULL)
-		++screen->hint_count;
+		++screen->hints.count;
 }
 
 void screen_goto(struct screen *screen, int index)
 {
-	if (index >= 0 && index < screen->item_count)
+	if (index >= 0 && index < screen->items.count)
 		screen->current = index;
 }
 
 static void adjust_viewport(struct screen *screen, int available_height)
 {
-	if (available_height >= screen->item_count)
+	if (available_height >= screen->items.count)
 		screen->top = 0;
 	else if (screen->current < screen->top)
 		screen->top = screen->current;
@@ -128,7 +134,7 @@ void screen_draw(struct screen *screen, WINDOW *window)
 	for (i = 0; i < available_height; ++i) {
 		const int item = screen->top + i;
 
-		if (item >= screen->item_count)
+		if (item >= screen->items.count)
 			break;
 
 		if (item == screen->current)
@@ -137,16 +143,16 @@ void screen_draw(struct screen *screen, WINDOW *window)
 		/* Work around a drawing issue in minicom by finishing drawing
 		 * on the next line.  Even if something lingers there, it should
 		 * be removed by drawing a box below. */
-		mvwprintw(window, 2 + i, 2, "%s\n", screen->items[item]);
+		mvwprintw(window, 2 + i, 2, "%s\n", screen->items.data[item]);
 
 		if (item == screen->current)
 			wattroff(window, A_REVERSE);
 	}
 
-	if (available_height >= screen->item_count + 1 + screen->hint_count) {
-		for (i = 0; i < screen->hint_count; ++i) {
-			const int line = 2 + screen->item_count + 1 + i;
-			mvwprintw(window, line, 2, "%s", screen->hints[i]);
+	if (available_height >= screen->items.count + 1 + screen->hints.count) {
+		for (i = 0; i < screen->hints.count; ++i) {
+			const int line = 2 + screen->items.count + 1 + i;
+			mvwprintw(window, line, 2, "%s", screen->hints.data[i]);
 		}
 	}
 
@@ -174,7 +180,7 @@ int screen_run(struct screen *screen, WINDOW *window)
 				break;
 			case 'j':
 			case KEY_DOWN:
-				if (screen->current < screen->item_count - 1)
+				if (screen->current < screen->items.count - 1)
 					++screen->current;
 				break;
 			case 'g':
@@ -182,8 +188,8 @@ int screen_run(struct screen *screen, WINDOW *window)
 				screen->current = 0;
 				break;
 			case KEY_END:
-				if (screen->item_count > 0)
-					screen->current = screen->item_count - 1;
+				if (screen->items.count > 0)
+					screen->current = screen->items.count - 1;
 				break;
 			default:
 				return key;
@@ -5,17 +5,16 @@
 
 #include <curses.h>
 
+#include "utils.h"
+
 #define CONTROL(key) ((key) & 0x1f)
 
 struct screen
 {
 	char *title;
 
-	int item_count;
-	char **items;
-
-	int hint_count;
-	char **hints;
+	VECTOR(char *) items;
+	VECTOR(char *) hints;
 
 	int top;
 	int current;
@@ -25,6 +24,7 @@ struct screen *screen_new(const char *title);
 void screen_free(struct screen *screen);
 
 void screen_add_item(struct screen *screen, const char *item);
+void screen_reserve_items(struct screen *screen, int count);
 void screen_clear_items(struct screen *screen);
 
 void screen_add_hint(struct screen *screen, const char *hint);
@@ -2,16 +2,47 @@
 
 #include "utils.h"
 
-#include <sys/types.h>
-#include <fcntl.h>
-#include <unistd.h>
-
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+bool arena_reset(struct arena *arena, size_t capacity)
+{
+	arena->used = 0;
+
+	if (arena->size < capacity) {
+		/* Nothing is allocated anymore, no need to preserve data */
+		free(arena->data);
+		arena->data = malloc(capacity);
+		arena->size = (arena->data == NULL ? 0 : capacity);
+	}
+
+	return (arena->size >= capacity);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *ptr;
+
+	size = ARENA_SIZE(size);
+	if (size > arena->size - arena->used)
+		return NULL;
+
+	ptr = arena->data + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+void arena_free(struct arena *arena)
+{
+	free(arena->data);
+	arena->data = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
+
 char *format_str(const char format[], ...)
 {
 	va_list ap;
@@ -32,31 +63,3 @@ char *format_str(const char format[], ...)
 
 	return buf;
 }
-
-bool skip_prefix(const char **str, const char *prefix)
-{
-	const size_t prefix_len = strlen(prefix);
-	if (strncmp(*str, prefix, prefix_len) == 0) {
-		*str += prefix_len;
-		return true;
-	}
-	return false;
-}
-
-FILE *temp_file(char *template)
-{
-	int fd;
-	FILE *file;
-
-	fd = mkstemp(template);
-	if (fd == -1)
-		return NULL;
-
-	file = fdopen(fd, "r+");
-	if (file == NULL) {
-		(void)unlink(template);
-		return NULL;
-	}
-
-	return file;
-}
@@ -4,21 +4,75 @@
 #define UTILS_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define ARRAY_SIZE(array) (sizeof(array)/sizeof((array)[0]))
 
-#define GROW_ARRAY(array, size) \
+/* Growable array of elements of the given type */
+#define VECTOR(type) \
+	struct { \
+		type *data; \
+		int count; \
+		int capacity; \
+	}
+
+/* Makes sure vector can hold n elements, evaluates to false on failure */
+#define VECTOR_RESERVE(vec, n) \
 	({ \
-		void *ptr = realloc((array), sizeof(*array)*((size) + 1)); \
-		if (ptr != NULL) { \
-			(array) = ptr; \
+		const int n_ = (n); \
+		bool ok_ = true; \
+		if (n_ > (vec).capacity) { \
+			void *ptr_ = realloc((vec).data, \
+					     sizeof(*(vec).data)*n_); \
+			if (ptr_ != NULL) { \
+				(vec).data = ptr_; \
+				(vec).capacity = n_; \
+			} \
+			ok_ = (ptr_ != NULL); \
 		} \
-		(ptr == NULL ? NULL : &(array)[size]); \
+		ok_; \
 	})
 
+/*
+ * Makes room for one more element by doubling capacity if it's exhausted.
+ * Evaluates to a pointer to the element past the last one or NULL on failure,
+ * count is left for the caller to increment.
+ */
+#define VECTOR_GROW(vec) \
+	(((vec).count < (vec).capacity || \
+	  VECTOR_RESERVE((vec), \
+			 (vec).capacity == 0 ? 4 : 2*(vec).capacity)) \
+	 ? &(vec).data[(vec).count] \
+	 : NULL)
+
+/* Releases unused capacity */
+#define VECTOR_SHRINK_TO_FIT(vec) \
+	do { \
+		void *ptr_; \
+		if ((vec).count == (vec).capacity) \
+			break; \
+		if ((vec).count == 0) { \
+			VECTOR_FREE(vec); \
+			break; \
+		} \
+		ptr_ = realloc((vec).data, sizeof(*(vec).data)*(vec).count); \
+		if (ptr_ != NULL) { \
+			(vec).data = ptr_; \
+			(vec).capacity = (vec).count; \
+		} \
+	} while (false)
+
+#define VECTOR_FREE(vec) \
+	do { \
+		free((vec).data); \
+		(vec).data = NULL; \
+		(vec).count = 0; \
+		(vec).capacity = 0; \
+	} while (false)
+
 /* Cyclically rotates (slice of) an array one element to the right */
 #define ROTATE_RIGHT(array, size) \
 	do { \
@@ -41,11 +95,36 @@
 		memcpy(&(array)[(size) - 1], buf, sizeof(buf)); \
 	} while (false)
 
-char *format_str(const char format[], ...)
-	__attribute__ ((format(printf, 1, 2)));
+/* Bump allocator whose allocations are all released at once */
+struct arena
+{
+	char *data;
+	size_t size;
+	size_t used;
+};
 
-bool skip_prefix(const char **str, const char *prefix);
+/*
+ * Releases all allocations and makes sure arena can hold at least capacity
+ * bytes.  Memory is allocated only if the arena has to grow, otherwise this is
+ * O(1).
+ */
+bool arena_reset(struct arena *arena, size_t capacity);
+/* Returns NULL if arena is out of space */
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena);
 
-FILE *temp_file(char *template);
+/* Size of an allocation from an arena including its alignment */
+#define ARENA_SIZE(size) \
+	(((size) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+/* Reference to a string which isn't necessarily NUL-terminated */
+struct str_view
+{
+	const char *data;
+	size_t len;
+};
+
+char *format_str(const char format[], ...)
+	__attribute__ ((format(printf, 1, 2)));
 
 #endif // UTILS_H__
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "worker_pool.h"
+
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+struct worker_pool
+{
+	worker_pool_fn fn;
+	void *ctx;
+	int count;
+
+	/* Next item to be taken */
+	int next;
+	bool failed;
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker_pool *pool = arg;
+	struct arena arena = { 0 };
+	int item;
+
+	while ((item = __atomic_fetch_add(&pool->next, 1,
+					  __ATOMIC_RELAXED)) < pool->count) {
+		if (!pool->fn(pool->ctx, &arena, item))
+			__atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+	}
+
+	arena_free(&arena);
+	return NULL;
+}
+
+bool worker_pool_run(int jobs, int count, worker_pool_fn fn, void *ctx)
+{
+	struct worker_pool pool = {
+		.fn = fn,
+		.ctx = ctx,
+		.count = count,
+		.next = 0,
+		.failed = false,
+	};
+	pthread_t *threads;
+	int started;
+
+	if (jobs > count)
+		jobs = count;
+
+	/* The calling thread is one of the workers */
+	threads = calloc(jobs > 1 ? jobs - 1 : 1, sizeof(*threads));
+	if (threads == NULL)
+		jobs = 1;
+
+	for (started = 0; started < jobs - 1; ++started) {
+		if (pthread_create(&threads[started], NULL, worker_main,
+				   &pool) != 0) {
+			/* Whatever threads were started will do the job */
+			fprintf(stderr, "Failed to start worker thread\n");
+			break;
+		}
+	}
+
+	(void)worker_main(&pool);
+
+	while (started > 0)
+		pthread_join(threads[--started], NULL);
+
+	free(threads);
+	return !pool.failed;
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef WORKER_POOL_H__
+#define WORKER_POOL_H__
+
+#include <stdbool.h>
+
+struct arena;
+
+/* Processes one item, arena belongs to the calling thread and can be reset */
+typedef bool (*worker_pool_fn)(void *ctx, struct arena *arena, int item);
+
+/*
+ * Calls fn for every item in [0; count) on up to jobs threads, the calling
+ * thread included.  Items are handed out one at a time in order.  Returns
+ * false if processing of any item has failed.
+ */
+bool worker_pool_run(int jobs, int count, worker_pool_fn fn, void *ctx);
+
+#endif // WORKER_POOL_H__
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Checks that only partial images turn devices into records of their own and
+ * that images with an empty bootorder_map are parsed as they always were.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/boot_data.h"
+#include "third-party/common.h"
+
+static const char BOOT_TEXT[] =
+	"/pci@i0cf8/usb@10/usb-*@1\r\n"
+	"/pci@i0cf8/usb@10/usb-*@2\r\n"
+	"/pci@i0cf8/*@11/drive@0/disk@0\r\n"
+	"usben0\r\n";
+
+static const char MAP_TEXT[] =
+	"a USB\r\n"
+	"a USB\r\n"
+	"b SATA\r\n";
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+static struct boot_data *parse(const char *map_text, bool no_map)
+{
+	struct buffer boot_file;
+	struct buffer map_file;
+
+	buffer_init(&boot_file, NULL, (char *)BOOT_TEXT, strlen(BOOT_TEXT));
+	buffer_init(&map_file, NULL, (char *)map_text, strlen(map_text));
+	return boot_data_new(/*arena=*/NULL, &boot_file, &map_file,
+			     /*bootorder_region=*/true, no_map);
+}
+
+/* Serializes map of boot data and returns its size */
+static size_t map_size(struct boot_data *boot)
+{
+	char sector[4096];
+	struct buffer map_file;
+
+	buffer_init(&map_file, NULL, sector, sizeof(sector));
+	if (!boot_data_dump_map(boot, &map_file))
+		return (size_t)-1;
+	return map_file.size;
+}
+
+static void test_full_image(void)
+{
+	struct boot_data *boot = parse(MAP_TEXT, /*no_map=*/false);
+
+	check(boot != NULL, "full image is parsed");
+	if (boot == NULL)
+		return;
+
+	check(boot->record_count == 2, "full image has records of map");
+	check(boot->records[0].device_count == 2,
+	      "first record has two devices");
+	check(map_size(boot) == strlen(MAP_TEXT), "map is written back");
+	boot_data_free(boot);
+}
+
+static void test_full_image_empty_map(void)
+{
+	struct boot_data *boot = parse("", /*no_map=*/false);
+
+	check(boot != NULL, "full image with empty map is parsed");
+	if (boot == NULL)
+		return;
+
+	check(boot->record_count == 0,
+	      "empty map doesn't make records out of devices");
+	check(map_size(boot) == 0, "empty map stays empty");
+	boot_data_free(boot);
+}
+
+static void test_partial_image(void)
+{
+	struct boot_data *boot = parse("", /*no_map=*/true);
+
+	check(boot != NULL, "partial image is parsed");
+	if (boot == NULL)
+		return;
+
+	check(boot->record_count == 3, "partial image has record per device");
+	check(boot->records[2].name.len ==
+	      strlen("/pci@i0cf8/*@11/drive@0/disk@0"),
+	      "record is named by device path");
+	boot_data_free(boot);
+}
+
+int main(void)
+{
+	test_full_image();
+	test_full_image_empty_map();
+	test_partial_image();
+
+	if (failures != 0)
+		return EXIT_FAILURE;
+
+	printf("boot data tests passed\n");
+	return EXIT_SUCCESS;
+}
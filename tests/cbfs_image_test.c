@@ -0,0 +1,386 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Checks that the CBFS index, the free list, transactions and placement of
+ * files within erase blocks agree with what walking CBFS finds.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "third-party/cbfs_image.h"
+
+#define IMAGE_SIZE (64 * 1024)
+#define BLOCK_SIZE 4096
+
+static char image_data[IMAGE_SIZE];
+/* Contents of files, transactions refer to it until they are committed */
+static char file_data[IMAGE_SIZE + 1];
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+/* Formats image_data as CBFS made of a single empty entry */
+static void make_image(struct cbfs_image *image)
+{
+	struct buffer buffer;
+	const size_t min_entry_size = cbfs_calculate_file_header_size("");
+
+	memset(image_data, 0xff, sizeof(image_data));
+	/* Last 4 bytes are kept for master header pointer */
+	cbfs_create_empty_entry((struct cbfs_file *)image_data, CBFS_TYPE_NULL,
+				IMAGE_SIZE - min_entry_size - sizeof(int32_t),
+				"");
+
+	buffer_init(&buffer, NULL, image_data, sizeof(image_data));
+	if (cbfs_image_from_buffer(image, &buffer, ~0u, false) != 0) {
+		fprintf(stderr, "Failed to create CBFS\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static bool add_file(struct cbfs_image *image, const char *name, size_t size,
+		     char fill)
+{
+	struct buffer buffer;
+	struct cbfs_file *header;
+	int ret;
+
+	header = cbfs_create_file_header(CBFS_TYPE_RAW, size, name);
+	if (header == NULL)
+		return false;
+
+	memset(file_data, fill, size);
+	buffer_init(&buffer, (char *)name, file_data, size);
+	ret = cbfs_add_entry(image, &buffer, /*content_offset=*/0, header,
+			     /*len_align=*/0);
+
+	free(header);
+	return ret == 0;
+}
+
+static bool is_empty(const struct cbfs_file *entry)
+{
+	const uint32_t type = ntohl(entry->type);
+	return type == CBFS_TYPE_NULL || type == CBFS_TYPE_DELETED;
+}
+
+/* Looks a file up without the index, the first one of a name wins */
+static struct cbfs_file *walk_lookup(struct cbfs_image *image,
+				     const char *name)
+{
+	struct cbfs_file *entry;
+
+	for (entry = cbfs_find_first_entry(image);
+	     entry && cbfs_is_valid_entry(image, entry);
+	     entry = cbfs_find_next_entry(image, entry)) {
+		if (!is_empty(entry) && strcasecmp(entry->filename, name) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static uint32_t addr_of(struct cbfs_image *image, const char *name)
+{
+	return cbfs_get_entry_addr(image, cbfs_get_entry(image, name));
+}
+
+/* Returns first byte of a file or '\0' if there is no such file */
+static char content_of(struct cbfs_image *image, const char *name)
+{
+	struct cbfs_file *entry = cbfs_get_entry(image, name);
+	return entry == NULL ? '\0' : *(char *)CBFS_SUBHEADER(entry);
+}
+
+/* Checks that free list consists of whole empty entries, one per extent */
+static bool free_list_matches_walk(struct cbfs_image *image)
+{
+	const struct cbfs_free_list *list = &image->free_list;
+	struct cbfs_file *entry;
+	size_t count = 0;
+
+	if (!list->valid)
+		return false;
+
+	for (entry = cbfs_find_first_entry(image);
+	     entry && cbfs_is_valid_entry(image, entry);
+	     entry = cbfs_find_next_entry(image, entry)) {
+		const struct cbfs_extent *extent = &list->extents[count];
+
+		if (!is_empty(entry))
+			continue;
+
+		if (count == list->count ||
+		    extent->addr != cbfs_get_entry_addr(image, entry) ||
+		    extent->end != cbfs_get_entry_addr(image,
+					cbfs_find_next_entry(image, entry)))
+			return false;
+		++count;
+	}
+	return count == list->count;
+}
+
+static void test_index(void)
+{
+	struct cbfs_image image;
+	char name[16];
+	bool all_added = true;
+	bool all_found = true;
+	int i;
+
+	make_image(&image);
+
+	check(add_file(&image, "a", 100, 'a') &&
+	      add_file(&image, "b", 100, 'b') &&
+	      add_file(&image, "c", 100, 'c'), "files are added");
+
+	/* The duplicate is placed after the first "b", which stays visible */
+	check(add_file(&image, "B", 100, 'B'), "duplicate is added");
+	check(image.index.duplicates, "duplicate is noticed");
+	check(content_of(&image, "b") == 'b', "first duplicate is found");
+	check(cbfs_get_entry(&image, "B") == walk_lookup(&image, "b"),
+	      "lookup ignores case");
+
+	check(cbfs_remove_entry(&image, "b") == 0,
+	      "first duplicate is removed");
+	check(content_of(&image, "b") == 'B',
+	      "second duplicate becomes visible");
+	check(cbfs_remove_entry(&image, "b") == 0 &&
+	      cbfs_get_entry(&image, "b") == NULL,
+	      "second duplicate is removed");
+	check(content_of(&image, "a") == 'a' && content_of(&image, "c") == 'c',
+	      "other files are still found");
+
+	/* Enough files to grow the index, removals then shift probe chains */
+	for (i = 0; i < 100; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		all_added &= add_file(&image, name, 16, 'a' + i % 26);
+	}
+	check(all_added, "many files are added");
+
+	for (i = 0; i < 100; i += 3) {
+		snprintf(name, sizeof(name), "file%d", i);
+		all_found &= (cbfs_remove_entry(&image, name) == 0);
+	}
+	for (i = 0; i < 100; ++i) {
+		struct cbfs_file *entry;
+
+		snprintf(name, sizeof(name), "file%d", i);
+		entry = cbfs_get_entry(&image, name);
+		all_found &= (entry == walk_lookup(&image, name));
+		all_found &= ((entry == NULL) == (i % 3 == 0));
+	}
+	check(all_found, "index agrees with walk after removals");
+	check(free_list_matches_walk(&image), "free list agrees with walk");
+
+	cbfs_image_release(&image);
+}
+
+static void test_free_list(void)
+{
+	struct cbfs_image image;
+	uint32_t a, b, c, d;
+	uint32_t end;
+
+	make_image(&image);
+	check(image.free_list.count == 1, "new CBFS is a single free extent");
+	end = image.free_list.extents[0].end;
+
+	check(add_file(&image, "a", 200, 'a') &&
+	      add_file(&image, "b", 200, 'b') &&
+	      add_file(&image, "c", 200, 'c') &&
+	      add_file(&image, "d", 200, 'd'), "files are added");
+
+	a = addr_of(&image, "a");
+	b = addr_of(&image, "b");
+	c = addr_of(&image, "c");
+	d = addr_of(&image, "d");
+	check(a == 0 && a < b && b < c && c < d, "files are placed in order");
+
+	cbfs_remove_entry(&image, "b");
+	check(image.free_list.count == 2 &&
+	      image.free_list.extents[0].addr == b &&
+	      image.free_list.extents[0].end == c,
+	      "removed file becomes a separate extent");
+
+	/* Joins the last extent */
+	cbfs_remove_entry(&image, "d");
+	check(image.free_list.count == 2 &&
+	      image.free_list.extents[1].addr == d &&
+	      image.free_list.extents[1].end == end,
+	      "free space is joined with the following extent");
+
+	/* Joins the first extent, which then starts the list */
+	cbfs_remove_entry(&image, "a");
+	check(image.free_list.count == 2 &&
+	      image.free_list.extents[0].addr == a &&
+	      image.free_list.extents[0].end == c,
+	      "free space at the start is joined with the next extent");
+
+	cbfs_remove_entry(&image, "c");
+	check(image.free_list.count == 1 &&
+	      image.free_list.extents[0].addr == a &&
+	      image.free_list.extents[0].end == end,
+	      "free space is joined with extents on both sides");
+	check(free_list_matches_walk(&image),
+	      "extents are coalesced into single empty entries");
+
+	cbfs_image_release(&image);
+}
+
+static void test_transaction(void)
+{
+	static char before[IMAGE_SIZE];
+	struct cbfs_image image;
+	struct cbfs_transaction txn;
+	struct cbfs_extent extents[4];
+	struct buffer small;
+	struct buffer other;
+	struct buffer huge;
+	size_t extent_count;
+
+	make_image(&image);
+	check(add_file(&image, "a", 100, 'a') &&
+	      add_file(&image, "b", 100, 'b'), "files are added");
+
+	memcpy(before, image_data, sizeof(before));
+	extent_count = image.free_list.count;
+	memcpy(extents, image.free_list.extents,
+	       extent_count * sizeof(*extents));
+
+	memset(file_data, 'x', sizeof(file_data));
+	buffer_init(&small, NULL, file_data, 50);
+	buffer_init(&other, NULL, file_data, 100);
+	/* Larger than the whole image */
+	buffer_init(&huge, NULL, file_data, sizeof(file_data));
+
+	cbfs_transaction_init(&txn, &image);
+	check(cbfs_transaction_replace(&txn, "a", CBFS_TYPE_RAW, &small) == 0 &&
+	      cbfs_transaction_remove(&txn, "b") == 0 &&
+	      cbfs_transaction_add(&txn, "huge", CBFS_TYPE_RAW, &huge) == 0,
+	      "operations are staged");
+	check(cbfs_transaction_commit(&txn) != 0,
+	      "transaction that doesn't fit is rejected");
+	check(txn.touched_count == 0, "rejected transaction touches nothing");
+	cbfs_transaction_release(&txn);
+
+	check(memcmp(before, image_data, sizeof(before)) == 0,
+	      "rejected transaction leaves image untouched");
+	check(content_of(&image, "a") == 'a' && content_of(&image, "b") == 'b' &&
+	      cbfs_get_entry(&image, "huge") == NULL,
+	      "files are as they were");
+	check(image.free_list.count == extent_count &&
+	      memcmp(image.free_list.extents, extents,
+		     extent_count * sizeof(*extents)) == 0,
+	      "free list is as it was");
+
+	/* The same without the oversized file is applied as a whole */
+	cbfs_transaction_init(&txn, &image);
+	check(cbfs_transaction_replace(&txn, "a", CBFS_TYPE_RAW, &small) == 0 &&
+	      cbfs_transaction_remove(&txn, "b") == 0 &&
+	      cbfs_transaction_add(&txn, "c", CBFS_TYPE_RAW, &other) == 0,
+	      "operations are staged again");
+	check(cbfs_transaction_commit(&txn) == 0, "transaction is applied");
+	cbfs_transaction_release(&txn);
+
+	check(content_of(&image, "a") == 'x' &&
+	      cbfs_get_entry(&image, "b") == NULL &&
+	      content_of(&image, "c") == 'x',
+	      "all operations are applied");
+	check(free_list_matches_walk(&image),
+	      "free list agrees with walk after transaction");
+
+	cbfs_image_release(&image);
+}
+
+/*
+ * Makes a small hole in the first erase block and a file in the third one,
+ * which is then replaced by data that fits the hole but not the file's space.
+ * Returns new address of the file.
+ */
+static uint32_t replace_after_hole(uint32_t erase_block_size,
+				   uint32_t *old_addr,
+				   uint32_t *hole_addr)
+{
+	struct cbfs_image image;
+	struct cbfs_transaction txn;
+	struct buffer data;
+	uint32_t fill_addr;
+	uint32_t new_addr;
+
+	make_image(&image);
+
+	check(add_file(&image, "a", 1000, 'a') &&
+	      add_file(&image, "hole", 700, 'h'), "files are added");
+
+	/* Makes the next file start at the third erase block */
+	fill_addr = image.free_list.extents[0].addr;
+	check(add_file(&image, "fill", 2 * BLOCK_SIZE - fill_addr -
+		       cbfs_calculate_file_header_size("fill"), 'f') &&
+	      add_file(&image, "x", 500, 'x'), "more files are added");
+	check(addr_of(&image, "x") == 2 * BLOCK_SIZE,
+	      "file is at the start of an erase block");
+
+	*hole_addr = addr_of(&image, "hole");
+	*old_addr = addr_of(&image, "x");
+	cbfs_remove_entry(&image, "hole");
+
+	image.erase_block_size = erase_block_size;
+
+	memset(file_data, 'y', 650);
+	buffer_init(&data, NULL, file_data, 650);
+
+	cbfs_transaction_init(&txn, &image);
+	check(cbfs_transaction_replace(&txn, "x", CBFS_TYPE_RAW, &data) == 0 &&
+	      cbfs_transaction_commit(&txn) == 0, "file is replaced");
+	cbfs_transaction_release(&txn);
+
+	check(content_of(&image, "x") == 'y', "file has new data");
+	check(free_list_matches_walk(&image),
+	      "free list agrees with walk after replacement");
+
+	new_addr = addr_of(&image, "x");
+	cbfs_image_release(&image);
+	return new_addr;
+}
+
+static void test_erase_block_placement(void)
+{
+	uint32_t old_addr;
+	uint32_t hole_addr;
+	uint32_t new_addr;
+
+	new_addr = replace_after_hole(/*erase_block_size=*/0, &old_addr,
+				      &hole_addr);
+	check(new_addr == hole_addr,
+	      "without erase blocks the smallest fitting extent is used");
+
+	new_addr = replace_after_hole(BLOCK_SIZE, &old_addr, &hole_addr);
+	check(new_addr / BLOCK_SIZE == old_addr / BLOCK_SIZE,
+	      "file stays in the erase block it already changes");
+}
+
+int main(void)
+{
+	test_index();
+	test_free_list();
+	test_transaction();
+	test_erase_block_placement();
+
+	if (failures != 0)
+		return EXIT_FAILURE;
+
+	printf("CBFS image tests passed\n");
+	return EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 /* CBFS Image Manipulation */
 /* SPDX-License-Identifier: GPL-2.0-only */
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <stddef.h>
@@ -16,6 +17,7 @@
 
 #include "common.h"
 #include "cbfs_image.h"
+#include "memscan.h"
 
 /* Even though the file-adding functions---cbfs_add_entry() and
  * cbfs_add_entry_at()---perform their sizing checks against the beginning of
@@ -74,6 +76,406 @@ static int cbfs_fix_legacy_size(struct cbfs_image *image, char *hdr_loc)
 	return 0;
 }
 
+static bool cbfs_is_empty_type(uint32_t type)
+{
+	return type == CBFS_TYPE_NULL || type == CBFS_TYPE_DELETED;
+}
+
+/* CBFS directory index */
+
+#define CBFS_INDEX_MIN_CAPACITY 64
+
+/* Slots of the index are free when their type is CBFS_TYPE_NULL, which
+ * never describes a file. */
+static bool cbfs_index_slot_used(const struct cbfs_index_entry *slot)
+{
+	return slot->type != CBFS_TYPE_NULL;
+}
+
+/* FNV-1a hash of lowercased name to match strcasecmp() lookups */
+static uint32_t cbfs_index_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name != '\0'; ++name) {
+		hash ^= (uint8_t)tolower((unsigned char)*name);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct cbfs_file *cbfs_index_file(struct cbfs_image *image,
+					 const struct cbfs_index_entry *slot)
+{
+	return (struct cbfs_file *)(image->buffer.data + (int32_t)slot->addr);
+}
+
+static bool cbfs_indexed_type(uint32_t type)
+{
+	return !cbfs_is_empty_type(type);
+}
+
+static void cbfs_index_drop(struct cbfs_index *index)
+{
+	free(index->slots);
+	index->slots = NULL;
+	index->capacity = 0;
+	index->count = 0;
+	index->duplicates = false;
+}
+
+static bool cbfs_index_alloc(struct cbfs_index *index, size_t capacity)
+{
+	index->slots = malloc(capacity * sizeof(*index->slots));
+	if (index->slots == NULL) {
+		index->capacity = 0;
+		return false;
+	}
+
+	memset(index->slots, 0xff, capacity * sizeof(*index->slots));
+	index->capacity = capacity;
+	index->count = 0;
+	return true;
+}
+
+/* Returns slot holding the name or a free slot where it would go */
+static struct cbfs_index_entry *cbfs_index_probe(struct cbfs_image *image,
+						 const char *name,
+						 uint32_t hash)
+{
+	struct cbfs_index *index = &image->index;
+	size_t mask = index->capacity - 1;
+	size_t i;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		struct cbfs_index_entry *slot = &index->slots[i];
+		if (!cbfs_index_slot_used(slot))
+			return slot;
+		if (slot->hash == hash &&
+		    strcasecmp(cbfs_index_file(image, slot)->filename,
+			       name) == 0)
+			return slot;
+	}
+}
+
+static bool cbfs_index_grow(struct cbfs_image *image)
+{
+	struct cbfs_index *index = &image->index;
+	struct cbfs_index_entry *old_slots = index->slots;
+	size_t old_capacity = index->capacity;
+	size_t count = index->count;
+	size_t i;
+
+	if (!cbfs_index_alloc(index, old_capacity * 2)) {
+		index->slots = old_slots;
+		index->capacity = old_capacity;
+		return false;
+	}
+
+	for (i = 0; i < old_capacity; ++i) {
+		const struct cbfs_index_entry *old = &old_slots[i];
+		size_t mask = index->capacity - 1;
+		size_t j;
+
+		if (!cbfs_index_slot_used(old))
+			continue;
+
+		for (j = old->hash & mask;
+		     cbfs_index_slot_used(&index->slots[j]);
+		     j = (j + 1) & mask)
+			;
+		index->slots[j] = *old;
+	}
+
+	index->count = count;
+	free(old_slots);
+	return true;
+}
+
+/* Records a file, an earlier file of the same name stays visible */
+static void cbfs_index_insert(struct cbfs_image *image,
+			      struct cbfs_file *entry)
+{
+	struct cbfs_index *index = &image->index;
+	struct cbfs_index_entry *slot;
+	uint32_t type = ntohl(entry->type);
+	uint32_t addr = cbfs_get_entry_addr(image, entry);
+	uint32_t hash;
+
+	if (index->capacity == 0 || !cbfs_indexed_type(type))
+		return;
+
+	/* Keep load factor at or below one half */
+	if ((index->count + 1) * 2 > index->capacity &&
+	    !cbfs_index_grow(image)) {
+		/* Lookups fall back to walking the CBFS */
+		cbfs_index_drop(index);
+		return;
+	}
+
+	hash = cbfs_index_hash(entry->filename);
+	slot = cbfs_index_probe(image, entry->filename, hash);
+	if (cbfs_index_slot_used(slot)) {
+		index->duplicates = true;
+		if ((int32_t)slot->addr < (int32_t)addr)
+			return;
+	} else {
+		++index->count;
+	}
+
+	slot->hash = hash;
+	slot->addr = addr;
+	slot->type = type;
+	slot->len = ntohl(entry->len);
+}
+
+/* Deletes a slot shifting back entries of its probe sequence */
+static void cbfs_index_erase(struct cbfs_index *index,
+			     struct cbfs_index_entry *slot)
+{
+	size_t mask = index->capacity - 1;
+	size_t hole = slot - index->slots;
+	size_t i;
+
+	for (i = (hole + 1) & mask;
+	     cbfs_index_slot_used(&index->slots[i]);
+	     i = (i + 1) & mask) {
+		size_t home = index->slots[i].hash & mask;
+
+		/* Entry can't move if its home lies cyclically in (hole, i] */
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+
+		index->slots[hole] = index->slots[i];
+		hole = i;
+	}
+
+	memset(&index->slots[hole], 0xff, sizeof(index->slots[hole]));
+	--index->count;
+}
+
+/* CBFS free space */
+
+#define CBFS_FREE_LIST_MIN_CAPACITY 16
+
+static void cbfs_free_list_drop(struct cbfs_free_list *list)
+{
+	free(list->extents);
+	list->extents = NULL;
+	list->count = 0;
+	list->capacity = 0;
+	list->valid = false;
+}
+
+/* Returns position of the first extent that starts at or after addr */
+static size_t cbfs_free_list_lower_bound(const struct cbfs_free_list *list,
+					 uint32_t addr)
+{
+	size_t lo = 0;
+	size_t hi = list->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (list->extents[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void cbfs_free_list_remove_at(struct cbfs_free_list *list, size_t pos)
+{
+	memmove(&list->extents[pos], &list->extents[pos + 1],
+		(list->count - pos - 1) * sizeof(*list->extents));
+	--list->count;
+}
+
+/* Marks [extent->addr, extent->end) as free joining it with neighbouring
+ * extents, extent is updated to the resulting extent. */
+static bool cbfs_free_list_add(struct cbfs_free_list *list,
+			       struct cbfs_extent *extent)
+{
+	size_t pos;
+
+	if (!list->valid)
+		return false;
+
+	pos = cbfs_free_list_lower_bound(list, extent->addr);
+
+	if (pos < list->count && list->extents[pos].addr == extent->end) {
+		extent->end = list->extents[pos].end;
+		cbfs_free_list_remove_at(list, pos);
+	}
+	if (pos > 0 && list->extents[pos - 1].end == extent->addr) {
+		extent->addr = list->extents[pos - 1].addr;
+		list->extents[pos - 1].end = extent->end;
+		return true;
+	}
+
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity == 0 ?
+			CBFS_FREE_LIST_MIN_CAPACITY : list->capacity * 2;
+		struct cbfs_extent *extents =
+			realloc(list->extents, capacity * sizeof(*extents));
+		if (extents == NULL) {
+			cbfs_free_list_drop(list);
+			return false;
+		}
+		list->extents = extents;
+		list->capacity = capacity;
+	}
+
+	memmove(&list->extents[pos + 1], &list->extents[pos],
+		(list->count - pos) * sizeof(*list->extents));
+	list->extents[pos] = *extent;
+	++list->count;
+	return true;
+}
+
+/* Counts erase blocks covered by [addr, end) that aren't covered by
+ * prefer */
+static size_t cbfs_count_new_blocks(const struct cbfs_image *image,
+				    uint32_t addr, uint32_t end,
+				    const struct cbfs_extent *prefer)
+{
+	size_t block_size = image->erase_block_size;
+	size_t base = image->buffer.offset;
+	size_t first, last, count;
+
+	if (block_size == 0)
+		return 0;
+
+	first = (base + addr) / block_size;
+	last = (base + end - 1) / block_size;
+	count = last - first + 1;
+
+	if (prefer != NULL) {
+		size_t lo = (base + prefer->addr) / block_size;
+		size_t hi = (base + prefer->end - 1) / block_size;
+		if (lo < first)
+			lo = first;
+		if (hi > last)
+			hi = last;
+		if (lo <= hi)
+			count -= hi - lo + 1;
+	}
+	return count;
+}
+
+/* Picks an extent that can hold need_size bytes.  Extents that make the file
+ * change the fewest erase blocks beyond those in prefer (if any) win, ties
+ * go to the smallest extent and then to the first one. */
+static struct cbfs_extent *cbfs_free_list_best_fit(
+		const struct cbfs_image *image,
+		const struct cbfs_free_list *list, uint32_t need_size,
+		const struct cbfs_extent *prefer)
+{
+	uint32_t min_entry_size = cbfs_calculate_file_header_size("");
+	uint32_t align = image->has_header ? image->header.align :
+							CBFS_ALIGNMENT;
+	struct cbfs_extent *extent, *best = NULL;
+	size_t best_blocks = 0;
+
+	for (extent = list->extents; extent != list->extents + list->count;
+	     ++extent) {
+		uint32_t end;
+		size_t blocks;
+
+		if (extent->addr + need_size > extent->end)
+			continue;
+
+		/* The file and a header of the empty entry after it */
+		end = align_up(extent->addr + need_size, align) +
+		      min_entry_size;
+		if (end > extent->end)
+			end = extent->end;
+		blocks = cbfs_count_new_blocks(image, extent->addr, end,
+					       prefer);
+
+		if (best == NULL || blocks < best_blocks ||
+		    (blocks == best_blocks &&
+		     extent->end - extent->addr < best->end - best->addr)) {
+			best = extent;
+			best_blocks = blocks;
+		}
+	}
+	return best;
+}
+
+/* Records empty entries found between two addresses */
+static bool cbfs_free_list_scan(struct cbfs_image *image,
+				uint32_t addr,
+				uint32_t end)
+{
+	struct cbfs_file *entry =
+		(struct cbfs_file *)(image->buffer.data + (int32_t)addr);
+
+	for (; cbfs_is_valid_entry(image, entry) &&
+	       cbfs_get_entry_addr(image, entry) < end;
+	     entry = cbfs_find_next_entry(image, entry)) {
+		struct cbfs_extent extent;
+
+		if (!cbfs_is_empty_type(ntohl(entry->type)))
+			continue;
+
+		extent.addr = cbfs_get_entry_addr(image, entry);
+		extent.end = cbfs_get_entry_addr(image,
+				cbfs_find_next_entry(image, entry));
+		if (!cbfs_free_list_add(&image->free_list, &extent))
+			return false;
+	}
+	return true;
+}
+
+/* Turns a free extent into a single empty entry */
+static struct cbfs_file *cbfs_coalesce_free(struct cbfs_image *image,
+					    const struct cbfs_extent *extent)
+{
+	struct cbfs_file *entry =
+		(struct cbfs_file *)(image->buffer.data + (int32_t)extent->addr);
+	uint32_t min_entry_size = cbfs_calculate_file_header_size("");
+	size_t len = extent->end - extent->addr - min_entry_size;
+
+	/* keep space for master header pointer */
+	if ((uint8_t *)entry + min_entry_size + len >
+			(uint8_t *)buffer_get(&image->buffer) +
+			buffer_size(&image->buffer) - sizeof(int32_t)) {
+		len -= sizeof(int32_t);
+	}
+	cbfs_create_empty_entry(entry, CBFS_TYPE_NULL, len, "");
+	return entry;
+}
+
+/* Indexes files and collects free space of the image in a single walk */
+static void cbfs_image_scan(struct cbfs_image *image)
+{
+	struct cbfs_file *entry;
+	struct cbfs_free_list *list = &image->free_list;
+
+	cbfs_index_drop(&image->index);
+	(void)cbfs_index_alloc(&image->index, CBFS_INDEX_MIN_CAPACITY);
+
+	cbfs_free_list_drop(list);
+	list->valid = true;
+
+	for (entry = cbfs_find_first_entry(image);
+	     entry && cbfs_is_valid_entry(image, entry);
+	     entry = cbfs_find_next_entry(image, entry)) {
+		struct cbfs_extent extent;
+
+		if (!cbfs_is_empty_type(ntohl(entry->type))) {
+			cbfs_index_insert(image, entry);
+			continue;
+		}
+
+		extent.addr = cbfs_get_entry_addr(image, entry);
+		extent.end = cbfs_get_entry_addr(image,
+				cbfs_find_next_entry(image, entry));
+		(void)cbfs_free_list_add(list, &extent);
+	}
+}
+
 void cbfs_get_header(struct cbfs_header *header, void *src)
 {
 	struct buffer outheader;
@@ -91,7 +493,7 @@ void cbfs_get_header(struct cbfs_header *header, void *src)
 }
 
 int cbfs_image_from_buffer(struct cbfs_image *out, struct buffer *in,
-			   uint32_t offset)
+			   uint32_t offset, bool count_headers)
 {
 	assert(out);
 	assert(in);
@@ -99,16 +501,22 @@ int cbfs_image_from_buffer(struct cbfs_image *out, struct buffer *in,
 
 	buffer_clone(&out->buffer, in);
 	out->has_header = false;
+	memset(&out->index, 0, sizeof(out->index));
+	memset(&out->free_list, 0, sizeof(out->free_list));
+	out->erase_block_size = 0;
 
 	if (cbfs_is_valid_cbfs(out)) {
+		cbfs_image_scan(out);
 		return 0;
 	}
 
-	void *header_loc = cbfs_find_header(in->data, in->size, offset);
+	void *header_loc = cbfs_find_header(in->data, in->size, offset,
+					     count_headers);
 	if (header_loc) {
 		cbfs_get_header(&out->header, header_loc);
 		out->has_header = true;
 		cbfs_fix_legacy_size(out, header_loc);
+		cbfs_image_scan(out);
 		return 0;
 	} else if (offset != ~0u) {
 		ERROR("The -H switch is only valid on legacy images having CBFS master headers.\n");
@@ -118,6 +526,12 @@ int cbfs_image_from_buffer(struct cbfs_image *out, struct buffer *in,
 	return 1;
 }
 
+void cbfs_image_release(struct cbfs_image *image)
+{
+	cbfs_index_drop(&image->index);
+	cbfs_free_list_drop(&image->free_list);
+}
+
 /* Tries to add an entry with its data (CBFS_SUBHEADER) at given offset. */
 static int cbfs_add_entry_at(struct cbfs_image *image,
 			     struct cbfs_file *entry,
@@ -187,6 +601,8 @@ static int cbfs_add_entry_at(struct cbfs_image *image,
 		entry->len = htonl(ntohl(entry->len) + len_align - off);
 	}
 
+	cbfs_index_insert(image, entry);
+
 	// Process buffer AFTER entry.
 	entry = cbfs_find_next_entry(image, entry);
 	addr = cbfs_get_entry_addr(image, entry);
@@ -213,38 +629,39 @@ static int cbfs_add_entry_at(struct cbfs_image *image,
 	return 0;
 }
 
-int cbfs_add_entry(struct cbfs_image *image, struct buffer *buffer,
-		   uint32_t content_offset,
-		   struct cbfs_file *header,
-		   const size_t len_align)
+/* Adds a file into the best fitting free extent, which is reported as
+ * touched. Erase blocks in prefer are reused if possible. */
+static int cbfs_add_file(struct cbfs_image *image, struct buffer *buffer,
+			 uint32_t content_offset,
+			 const struct cbfs_file *header,
+			 const size_t len_align,
+			 const struct cbfs_extent *prefer,
+			 struct cbfs_extent *touched)
 {
 	assert(image);
 	assert(buffer);
 	assert(buffer->data);
 	assert(!IS_HOST_SPACE_ADDRESS(content_offset));
 
-	uint32_t entry_type;
-	uint32_t addr, addr_next;
-	struct cbfs_file *entry, *next;
+	struct cbfs_free_list *list = &image->free_list;
+	struct cbfs_extent *extent, *best = NULL;
+	struct cbfs_file *entry;
 	uint32_t need_size;
 	uint32_t header_size = ntohl(header->offset);
 
 	need_size = header_size + buffer->size;
 
-	// Merge empty entries.
-	cbfs_legacy_walk(image, cbfs_merge_empty_entry, NULL);
+	if (!list->valid)
+		cbfs_image_scan(image);
 
-	for (entry = cbfs_find_first_entry(image);
-	     entry && cbfs_is_valid_entry(image, entry);
-	     entry = cbfs_find_next_entry(image, entry)) {
+	// Best fit keeps large extents for large files
+	if (content_offset == 0)
+		best = cbfs_free_list_best_fit(image, list, need_size, prefer);
 
-		entry_type = ntohl(entry->type);
-		if (entry_type != CBFS_TYPE_NULL)
-			continue;
-
-		addr = cbfs_get_entry_addr(image, entry);
-		next = cbfs_find_next_entry(image, entry);
-		addr_next = cbfs_get_entry_addr(image, next);
+	for (extent = list->extents;
+	     content_offset > 0 && extent != list->extents + list->count;
+	     ++extent) {
+		uint32_t addr = extent->addr, addr_next = extent->end;
 
 		/* Will the file fit? Don't yet worry if we have space for a new
 		 * "empty" entry. We take care of that later.
@@ -253,34 +670,39 @@ int cbfs_add_entry(struct cbfs_image *image, struct buffer *buffer,
 			continue;
 
 		// Test for complicated cases
-		if (content_offset > 0) {
-			if (addr_next < content_offset) {
-				continue;
-			} else if (addr > content_offset) {
-				break;
-			} else if (addr + header_size > content_offset) {
-				ERROR("Not enough space for header.\n");
-				break;
-			} else if (content_offset + buffer->size > addr_next) {
-				ERROR("Not enough space for content.\n");
-				break;
-			}
+		if (addr_next < content_offset) {
+			continue;
+		} else if (addr > content_offset) {
+			break;
+		} else if (addr + header_size > content_offset) {
+			ERROR("Not enough space for header.\n");
+			break;
+		} else if (content_offset + buffer->size > addr_next) {
+			ERROR("Not enough space for content.\n");
+			break;
 		}
+		best = extent;
+		break;
+	}
 
-		// TODO there are more few tricky cases that we may
-		// want to fit by altering offset.
+	if (best != NULL) {
+		struct cbfs_extent free_extent = *best;
 
-		if (content_offset == 0) {
-			// we tested every condition earlier under which
-			// placing the file there might fail
-			content_offset = addr + header_size;
-		}
+		entry = cbfs_coalesce_free(image, &free_extent);
+		if (content_offset == 0)
+			content_offset = free_extent.addr + header_size;
 
 		if (cbfs_add_entry_at(image, entry, buffer->data,
 				      content_offset, header, len_align) == 0) {
+			// Whatever is left of the extent is free again
+			cbfs_free_list_remove_at(list, best - list->extents);
+			if (!cbfs_free_list_scan(image, free_extent.addr,
+						 free_extent.end))
+				cbfs_free_list_drop(list);
+			if (touched != NULL)
+				*touched = free_extent;
 			return 0;
 		}
-		break;
 	}
 
 	ERROR("Could not add [%s, %zd bytes (%zd KB)@0x%x]; too big?\n",
@@ -288,9 +710,126 @@ int cbfs_add_entry(struct cbfs_image *image, struct buffer *buffer,
 	return -1;
 }
 
+int cbfs_add_entry(struct cbfs_image *image, struct buffer *buffer,
+		   uint32_t content_offset,
+		   struct cbfs_file *header,
+		   const size_t len_align)
+{
+	return cbfs_add_file(image, buffer, content_offset, header, len_align,
+			     /*prefer=*/NULL, /*touched=*/NULL);
+}
+
+/* Checks whether data of given size and type can replace data of the entry
+ * in place. Reports where the entry's space ends and where the entry would
+ * end after the update. */
+static bool cbfs_update_fits(struct cbfs_image *image, struct cbfs_file *entry,
+			     size_t size, uint32_t type,
+			     uint32_t *addr_next, uint32_t *new_next)
+{
+	uint32_t addr = cbfs_get_entry_addr(image, entry);
+	uint32_t min_entry_size = cbfs_calculate_file_header_size("");
+	uint32_t align = image->has_header ? image->header.align :
+							CBFS_ALIGNMENT;
+	uint32_t offset = ntohl(entry->offset);
+	uint32_t capacity;
+
+	// Attributes (hashes, compression) would go stale
+	if (ntohl(entry->type) != type || entry->attributes_offset != 0)
+		return false;
+
+	*addr_next =
+		cbfs_get_entry_addr(image, cbfs_find_next_entry(image, entry));
+
+	capacity = *addr_next - addr - offset;
+	/* keep space for master header pointer */
+	if (*addr_next > buffer_size(&image->buffer) - sizeof(int32_t))
+		capacity -= sizeof(int32_t);
+	if (size > capacity)
+		return false;
+
+	*new_next = align_up(addr + offset + size, align);
+	return *new_next == *addr_next ||
+	       *addr_next - *new_next >= min_entry_size;
+}
+
+/* Replaces data in place, the entry's space is reported as touched */
+static int cbfs_update_file(struct cbfs_image *image, struct cbfs_file *entry,
+			    const struct buffer *buffer, uint32_t type,
+			    struct cbfs_extent *touched)
+{
+	assert(image);
+	assert(entry);
+	assert(buffer);
+
+	struct cbfs_file *next;
+	struct cbfs_extent extent;
+	struct cbfs_index_entry *slot = NULL;
+	uint32_t addr = cbfs_get_entry_addr(image, entry);
+	uint32_t min_entry_size = cbfs_calculate_file_header_size("");
+	uint32_t old_len = ntohl(entry->len);
+	uint32_t addr_next, new_next, len;
+
+	if (!cbfs_update_fits(image, entry, buffer->size, type, &addr_next,
+			      &new_next))
+		return -1;
+
+	if (image->index.capacity != 0)
+		slot = cbfs_index_probe(image, entry->filename,
+					cbfs_index_hash(entry->filename));
+
+	memcpy(CBFS_SUBHEADER(entry), buffer->data, buffer->size);
+	if (buffer->size < old_len)
+		memset(CBFS_SUBHEADER(entry) + buffer->size,
+		       CBFS_CONTENT_DEFAULT_VALUE, old_len - buffer->size);
+	entry->len = htonl(buffer->size);
+
+	if (slot != NULL && slot->addr == addr)
+		slot->len = buffer->size;
+
+	if (touched != NULL) {
+		touched->addr = addr;
+		touched->end = addr_next;
+	}
+
+	if (new_next == addr_next)
+		return 0;
+
+	// Process buffer AFTER entry.
+	len = addr_next - new_next - min_entry_size;
+
+	next = cbfs_find_next_entry(image, entry);
+	if ((uint8_t *)next + min_entry_size + len >
+			(uint8_t *)buffer_get(&image->buffer) +
+			buffer_size(&image->buffer) - sizeof(int32_t)) {
+		len -= sizeof(int32_t);
+	}
+	cbfs_create_empty_entry(next, CBFS_TYPE_NULL, len, "");
+
+	extent.addr = new_next;
+	extent.end = addr_next;
+	if (!cbfs_free_list_add(&image->free_list, &extent))
+		cbfs_free_list_drop(&image->free_list);
+	return 0;
+}
+
+int cbfs_update_entry(struct cbfs_image *image, struct cbfs_file *entry,
+		      const struct buffer *buffer, uint32_t type)
+{
+	return cbfs_update_file(image, entry, buffer, type, /*touched=*/NULL);
+}
+
 struct cbfs_file *cbfs_get_entry(struct cbfs_image *image, const char *name)
 {
 	struct cbfs_file *entry;
+
+	if (image->index.capacity != 0) {
+		const struct cbfs_index_entry *slot =
+			cbfs_index_probe(image, name, cbfs_index_hash(name));
+		if (!cbfs_index_slot_used(slot))
+			return NULL;
+		return cbfs_index_file(image, slot);
+	}
+
 	for (entry = cbfs_find_first_entry(image);
 	     entry && cbfs_is_valid_entry(image, entry);
 	     entry = cbfs_find_next_entry(image, entry)) {
@@ -301,6 +840,40 @@ struct cbfs_file *cbfs_get_entry(struct cbfs_image *image, const char *name)
 	return NULL;
 }
 
+/* Removes a file, the resulting free extent is reported as touched */
+static void cbfs_remove_file(struct cbfs_image *image, struct cbfs_file *entry,
+			     struct cbfs_extent *touched)
+{
+	struct cbfs_extent extent;
+	extent.addr = cbfs_get_entry_addr(image, entry);
+	extent.end = cbfs_get_entry_addr(image,
+					 cbfs_find_next_entry(image, entry));
+
+	/* Slots are found by comparing names, so erase before the merge */
+	if (image->index.capacity != 0 && !image->index.duplicates)
+		cbfs_index_erase(&image->index,
+				 cbfs_index_probe(image, entry->filename,
+						  cbfs_index_hash(entry->filename)));
+
+	entry->type = htonl(CBFS_TYPE_DELETED);
+
+	/* Only the space around the removed file needs merging */
+	if (cbfs_free_list_add(&image->free_list, &extent)) {
+		cbfs_coalesce_free(image, &extent);
+	} else {
+		cbfs_legacy_walk(image, cbfs_merge_empty_entry, NULL);
+		extent.addr = 0;
+		extent.end = buffer_size(&image->buffer);
+	}
+
+	/* A file hidden by the removed one might need to become visible */
+	if (image->index.duplicates)
+		cbfs_image_scan(image);
+
+	if (touched != NULL)
+		*touched = extent;
+}
+
 int cbfs_remove_entry(struct cbfs_image *image, const char *name)
 {
 	struct cbfs_file *entry;
@@ -309,8 +882,267 @@ int cbfs_remove_entry(struct cbfs_image *image, const char *name)
 		ERROR("CBFS file %s not found.\n", name);
 		return -1;
 	}
-	entry->type = htonl(CBFS_TYPE_DELETED);
-	cbfs_legacy_walk(image, cbfs_merge_empty_entry, NULL);
+
+	cbfs_remove_file(image, entry, /*touched=*/NULL);
+	return 0;
+}
+
+/* CBFS transactions */
+
+enum cbfs_transaction_kind {
+	CBFS_TRANSACTION_REMOVE,
+	CBFS_TRANSACTION_ADD,
+	CBFS_TRANSACTION_REPLACE,
+};
+
+struct cbfs_transaction_op {
+	enum cbfs_transaction_kind kind;
+	const char *name;
+	uint32_t type;
+	struct buffer buffer;
+	/* Created when staging so that applying can't run out of memory */
+	struct cbfs_file *header;
+};
+
+void cbfs_transaction_init(struct cbfs_transaction *txn,
+			   struct cbfs_image *image)
+{
+	memset(txn, 0, sizeof(*txn));
+	txn->image = image;
+}
+
+void cbfs_transaction_release(struct cbfs_transaction *txn)
+{
+	size_t i;
+
+	for (i = 0; i < txn->op_count; ++i)
+		free(txn->ops[i].header);
+	free(txn->ops);
+	free(txn->touched);
+	cbfs_transaction_init(txn, txn->image);
+}
+
+static int cbfs_transaction_stage(struct cbfs_transaction *txn,
+				  enum cbfs_transaction_kind kind,
+				  const char *name,
+				  uint32_t type,
+				  const struct buffer *buffer)
+{
+	struct cbfs_transaction_op *op;
+	bool exists = (cbfs_get_entry(txn->image, name) != NULL);
+	size_t i;
+
+	for (i = 0; i < txn->op_count; ++i) {
+		if (strcasecmp(txn->ops[i].name, name) == 0) {
+			ERROR("CBFS file %s is already part of the transaction.\n",
+			      name);
+			return -1;
+		}
+	}
+
+	if (kind == CBFS_TRANSACTION_REMOVE && !exists) {
+		ERROR("CBFS file %s not found.\n", name);
+		return -1;
+	}
+	if (kind == CBFS_TRANSACTION_ADD && exists) {
+		ERROR("CBFS file %s already exists.\n", name);
+		return -1;
+	}
+
+	if (txn->op_count == txn->op_capacity) {
+		size_t capacity = txn->op_capacity == 0 ?
+			4 : txn->op_capacity * 2;
+		op = realloc(txn->ops, capacity * sizeof(*op));
+		if (op == NULL) {
+			ERROR("Out of memory.\n");
+			return -1;
+		}
+		txn->ops = op;
+		txn->op_capacity = capacity;
+	}
+
+	op = &txn->ops[txn->op_count];
+	memset(op, 0, sizeof(*op));
+	op->kind = kind;
+	op->name = name;
+	op->type = type;
+
+	if (kind != CBFS_TRANSACTION_REMOVE) {
+		buffer_clone(&op->buffer, buffer);
+		op->buffer.name = (char *)name;
+		op->header = cbfs_create_file_header(type, buffer->size, name);
+		if (op->header == NULL) {
+			ERROR("Out of memory.\n");
+			return -1;
+		}
+	}
+
+	++txn->op_count;
+	return 0;
+}
+
+int cbfs_transaction_remove(struct cbfs_transaction *txn, const char *name)
+{
+	return cbfs_transaction_stage(txn, CBFS_TRANSACTION_REMOVE, name,
+				      CBFS_TYPE_NULL, NULL);
+}
+
+int cbfs_transaction_add(struct cbfs_transaction *txn, const char *name,
+			 uint32_t type, const struct buffer *buffer)
+{
+	return cbfs_transaction_stage(txn, CBFS_TRANSACTION_ADD, name, type,
+				      buffer);
+}
+
+int cbfs_transaction_replace(struct cbfs_transaction *txn, const char *name,
+			     uint32_t type, const struct buffer *buffer)
+{
+	return cbfs_transaction_stage(txn, CBFS_TRANSACTION_REPLACE, name, type,
+				      buffer);
+}
+
+/* Mirrors effect of an operation on a copy of the free list the same way
+ * applying it affects the real one */
+static bool cbfs_transaction_simulate(struct cbfs_image *image,
+				      const struct cbfs_transaction_op *op,
+				      struct cbfs_free_list *list)
+{
+	struct cbfs_file *entry = cbfs_get_entry(image, op->name);
+	uint32_t min_entry_size = cbfs_calculate_file_header_size("");
+	uint32_t align = image->has_header ? image->header.align :
+							CBFS_ALIGNMENT;
+	uint32_t need_size, used_end;
+	struct cbfs_extent extent, old_place, *best;
+	const struct cbfs_extent *prefer = NULL;
+
+	if (entry != NULL && op->kind == CBFS_TRANSACTION_REPLACE) {
+		uint32_t addr_next, new_next;
+		if (cbfs_update_fits(image, entry, op->buffer.size, op->type,
+				     &addr_next, &new_next)) {
+			if (new_next == addr_next)
+				return true;
+			extent.addr = new_next;
+			extent.end = addr_next;
+			return cbfs_free_list_add(list, &extent);
+		}
+	}
+
+	if (entry != NULL) {
+		old_place.addr = cbfs_get_entry_addr(image, entry);
+		old_place.end = cbfs_get_entry_addr(image,
+				cbfs_find_next_entry(image, entry));
+		prefer = &old_place;
+
+		extent = old_place;
+		if (!cbfs_free_list_add(list, &extent))
+			return false;
+	}
+
+	if (op->kind == CBFS_TRANSACTION_REMOVE)
+		return true;
+
+	need_size = ntohl(op->header->offset) + op->buffer.size;
+	best = cbfs_free_list_best_fit(image, list, need_size, prefer);
+	if (best == NULL) {
+		ERROR("Could not add [%s, %zd bytes (%zd KB)]; too big?\n",
+		      op->name, op->buffer.size, op->buffer.size / 1024);
+		return false;
+	}
+
+	extent = *best;
+	cbfs_free_list_remove_at(list, best - list->extents);
+
+	used_end = align_up(extent.addr + need_size, align);
+	if (extent.end - used_end < min_entry_size)
+		return true;
+
+	extent.addr = used_end;
+	return cbfs_free_list_add(list, &extent);
+}
+
+static bool cbfs_transaction_check(struct cbfs_transaction *txn)
+{
+	struct cbfs_image *image = txn->image;
+	struct cbfs_free_list list;
+	size_t i;
+	bool success = true;
+
+	if (!image->free_list.valid)
+		cbfs_image_scan(image);
+
+	/* Extra slot keeps the size non-zero */
+	list = image->free_list;
+	list.capacity = image->free_list.count + 1;
+	list.extents = malloc(list.capacity * sizeof(*list.extents));
+	if (list.extents == NULL) {
+		ERROR("Out of memory.\n");
+		return false;
+	}
+	if (list.count != 0)
+		memcpy(list.extents, image->free_list.extents,
+		       list.count * sizeof(*list.extents));
+
+	for (i = 0; i < txn->op_count && success; ++i)
+		success = cbfs_transaction_simulate(image, &txn->ops[i], &list);
+
+	free(list.extents);
+	return success;
+}
+
+int cbfs_transaction_commit(struct cbfs_transaction *txn)
+{
+	struct cbfs_image *image = txn->image;
+	size_t i;
+
+	if (!cbfs_transaction_check(txn))
+		return -1;
+
+	/* Replacing a file can touch both its old and new places */
+	free(txn->touched);
+	txn->touched_count = 0;
+	txn->touched = malloc(2 * txn->op_count * sizeof(*txn->touched));
+	if (txn->touched == NULL && txn->op_count != 0) {
+		ERROR("Out of memory.\n");
+		return -1;
+	}
+
+	for (i = 0; i < txn->op_count; ++i) {
+		struct cbfs_transaction_op *op = &txn->ops[i];
+		struct cbfs_file *entry = cbfs_get_entry(image, op->name);
+		struct cbfs_extent old_place;
+		const struct cbfs_extent *prefer = NULL;
+
+		if (entry != NULL && op->kind == CBFS_TRANSACTION_REPLACE &&
+		    cbfs_update_file(image, entry, &op->buffer, op->type,
+				     &txn->touched[txn->touched_count]) == 0) {
+			++txn->touched_count;
+			continue;
+		}
+
+		/* A new place within the same erase blocks is preferred */
+		if (entry != NULL) {
+			old_place.addr = cbfs_get_entry_addr(image, entry);
+			old_place.end = cbfs_get_entry_addr(image,
+					cbfs_find_next_entry(image, entry));
+			prefer = &old_place;
+
+			cbfs_remove_file(image, entry,
+					 &txn->touched[txn->touched_count++]);
+		}
+
+		if (op->kind == CBFS_TRANSACTION_REMOVE)
+			continue;
+
+		if (cbfs_add_file(image, &op->buffer, /*content_offset=*/0,
+				  op->header, /*len_align=*/0, prefer,
+				  &txn->touched[txn->touched_count]) != 0) {
+			/* Checks above should make this impossible */
+			ERROR("CBFS transaction was applied partially.\n");
+			return -1;
+		}
+		++txn->touched_count;
+	}
+
 	return 0;
 }
 
@@ -377,13 +1209,42 @@ static int cbfs_header_valid(struct cbfs_header *header)
 	return 0;
 }
 
+/* Returns offset of the first valid header at or after offset among those
+ * at multiples of stride, or -1 */
+static long cbfs_scan_header(char *data, size_t size, size_t offset,
+			     size_t stride)
+{
+	const uint32_t magic = htonl(CBFS_HEADER_MAGIC);
+
+	while (offset + sizeof(struct cbfs_header) < size) {
+		long found = memscan(data + offset, size - offset, &magic,
+				     sizeof(magic), stride);
+		if (found < 0)
+			return -1;
+
+		offset += found;
+		if (offset + sizeof(struct cbfs_header) >= size)
+			return -1;
+		if (cbfs_header_valid((struct cbfs_header *)(data + offset)))
+			return offset;
+
+		offset += stride;
+	}
+	return -1;
+}
+
+/* Headers are stored in CBFS files and end up 4-byte aligned */
+#define CBFS_HEADER_STRIDE 4
+
 struct cbfs_header *cbfs_find_header(char *data, size_t size,
-				     uint32_t forced_offset)
+				     uint32_t forced_offset, bool count_headers)
 {
 	size_t offset;
+	long found_at;
 	int found = 0;
 	int32_t rel_offset;
 	struct cbfs_header *header, *result = NULL;
+	struct cbfs_file *first;
 
 	if (forced_offset < (size - sizeof(struct cbfs_header))) {
 		/* Check if the forced header is valid. */
@@ -401,22 +1262,46 @@ struct cbfs_header *cbfs_find_header(char *data, size_t size,
 	    !cbfs_header_valid((struct cbfs_header *)(data + offset))) {
 		// Some use cases append non-CBFS data to the end of the ROM.
 		offset = 0;
+	} else if (!count_headers) {
+		return (struct cbfs_header *)(data + offset);
 	}
 
-	for (; offset + sizeof(*header) < size; offset++) {
-		header = (struct cbfs_header *)(data + offset);
-		if (!cbfs_header_valid(header))
-			continue;
-		if (!found++)
-			result = header;
+	if (count_headers) {
+		// Diagnostic mode: look at every byte like cbfstool does.
+		while ((found_at = cbfs_scan_header(data, size, offset,
+						    1)) >= 0) {
+			if (!found++)
+				result = (struct cbfs_header *)(data + found_at);
+			offset = found_at + 1;
+		}
+		if (found > 1)
+			// Top-aligned images usually have a working relative
+			// offset field, so this is more likely to happen on
+			// bottom-aligned ones (where the first header is the
+			// "outermost" one)
+			WARN("Multiple (%d) CBFS headers found, using the first one.\n",
+			       found);
+		return result;
 	}
-	if (found > 1)
-		// Top-aligned images usually have a working relative offset
-		// field, so this is more likely to happen on bottom-aligned
-		// ones (where the first header is the "outermost" one)
-		WARN("Multiple (%d) CBFS headers found, using the first one.\n",
-		       found);
-	return result;
+
+	// Bottom-aligned images start with the header or with a file holding it.
+	if (cbfs_header_valid((struct cbfs_header *)data))
+		return (struct cbfs_header *)data;
+	first = (struct cbfs_file *)data;
+	if (size > sizeof(*first) &&
+	    memcmp(first->magic, CBFS_FILE_MAGIC, sizeof(first->magic)) == 0 &&
+	    ntohl(first->offset) < size - sizeof(*header) &&
+	    cbfs_header_valid((struct cbfs_header *)(data +
+						      ntohl(first->offset))))
+		return (struct cbfs_header *)(data + ntohl(first->offset));
+
+	found_at = cbfs_scan_header(data, size, 0, CBFS_HEADER_STRIDE);
+	if (found_at < 0)
+		// Unaligned headers are only found by a bytewise scan.
+		found_at = cbfs_scan_header(data, size, 0, 1);
+	if (found_at < 0)
+		return NULL;
+	return (struct cbfs_header *)(data + found_at);
 }
 
 
@@ -480,6 +1365,8 @@ struct cbfs_file *cbfs_create_file_header(int type,
 			    size_t len, const char *name)
 {
 	struct cbfs_file *entry = malloc(CBFS_METADATA_MAX_SIZE);
+	if (!entry)
+		return NULL;
 	memset(entry, CBFS_CONTENT_DEFAULT_VALUE, CBFS_METADATA_MAX_SIZE);
 	memcpy(entry->magic, CBFS_FILE_MAGIC, sizeof(entry->magic));
 	entry->type = htonl(type);
@@ -9,12 +9,55 @@
 
 /* CBFS image processing */
 
+/* Location and properties of a non-empty file in the CBFS */
+struct cbfs_index_entry {
+	uint32_t hash;
+	/* Address of the entry (see cbfs_get_entry_addr()) */
+	uint32_t addr;
+	uint32_t type;
+	uint32_t len;
+};
+
+/* Open-addressing hash table of files by case-insensitive name */
+struct cbfs_index {
+	struct cbfs_index_entry *slots;
+	/* Power of two, or zero if the index isn't available */
+	size_t capacity;
+	size_t count;
+	/* Whether some name occurs more than once */
+	bool duplicates;
+};
+
+/* Free space [addr, end) made of one or more adjacent empty entries */
+struct cbfs_extent {
+	uint32_t addr;
+	uint32_t end;
+};
+
+/* Free extents sorted by address, none of them adjacent */
+struct cbfs_free_list {
+	struct cbfs_extent *extents;
+	size_t count;
+	size_t capacity;
+	/* Cleared when an update fails, the next use rebuilds the list */
+	bool valid;
+};
+
 struct cbfs_image {
 	struct buffer buffer;
 	/* An image has a header iff it's a legacy CBFS. */
 	bool has_header;
 	/* Only meaningful if has_header is selected. */
 	struct cbfs_header header;
+	/* Built by cbfs_image_from_buffer() and kept up to date by functions
+	 * that add or remove entries. */
+	struct cbfs_index index;
+	/* Maintained along with the index */
+	struct cbfs_free_list free_list;
+	/* Placement of files changes as few flash erase blocks of this size as
+	 * possible, 0 by default meaning blocks aren't considered. Blocks are
+	 * aligned relative to the beginning of the original buffer. */
+	uint32_t erase_block_size;
 };
 
 /* Or deserialize into host-native format */
@@ -23,11 +66,16 @@ void cbfs_get_header(struct cbfs_header *header, void *src);
 /* Constructs a cbfs_image from a buffer. The resulting image contains a shallow
  * copy of the buffer; releasing either one is the legal way to clean up after
  * both of them at once. Always produces a cbfs_image, but...
+ * count_headers is passed on to cbfs_find_header() for legacy images.
  * Returns 0 if it contains a valid CBFS, non-zero if it's unrecognized data. */
 int cbfs_image_from_buffer(struct cbfs_image *out, struct buffer *in,
-			   uint32_t offset);
+			   uint32_t offset, bool count_headers);
 
-/* Returns a pointer to entry by name, or NULL if name is not found. */
+/* Releases memory allocated by cbfs_image_from_buffer(), but not the buffer. */
+void cbfs_image_release(struct cbfs_image *image);
+
+/* Returns a pointer to entry by name, or NULL if name is not found.
+ * Lookups go through the index in constant time. */
 struct cbfs_file *cbfs_get_entry(struct cbfs_image *image, const char *name);
 
 /* Adds an entry to CBFS image by given name and type. If content_offset is
@@ -38,9 +86,49 @@ int cbfs_add_entry(struct cbfs_image *image, struct buffer *buffer,
 		   uint32_t content_offset, struct cbfs_file *header,
 		   const size_t len_align);
 
+/* Replaces data of a file of given type without moving it when the new data
+ * fits in the space the file occupies and the file has no attributes. Space
+ * freed at the end becomes an empty entry. Returns 0 on success, otherwise
+ * non-zero and the image is left untouched. */
+int cbfs_update_entry(struct cbfs_image *image, struct cbfs_file *entry,
+		      const struct buffer *buffer, uint32_t type);
+
 /* Removes an entry from CBFS image. Returns 0 on success, otherwise non-zero. */
 int cbfs_remove_entry(struct cbfs_image *image, const char *name);
 
+/* A batch of modifications of a CBFS image that is either applied as a whole
+ * or not at all. File names and data are referenced rather than copied and
+ * must stay valid until cbfs_transaction_commit() returns. */
+struct cbfs_transaction {
+	struct cbfs_image *image;
+	struct cbfs_transaction_op *ops;
+	size_t op_count;
+	size_t op_capacity;
+	/* Ranges of image buffer modified by cbfs_transaction_commit() */
+	struct cbfs_extent *touched;
+	size_t touched_count;
+};
+
+void cbfs_transaction_init(struct cbfs_transaction *txn,
+			   struct cbfs_image *image);
+
+/* Frees memory of a transaction, committed or not */
+void cbfs_transaction_release(struct cbfs_transaction *txn);
+
+/* Staging functions only verify the request. A file can be part of a single
+ * operation. Return 0 on success, otherwise non-zero. */
+int cbfs_transaction_remove(struct cbfs_transaction *txn, const char *name);
+int cbfs_transaction_add(struct cbfs_transaction *txn, const char *name,
+			 uint32_t type, const struct buffer *buffer);
+/* Adds a file or replaces data of an existing one, in place if possible */
+int cbfs_transaction_replace(struct cbfs_transaction *txn, const char *name,
+			     uint32_t type, const struct buffer *buffer);
+
+/* Checks that all staged operations can be performed and only then applies
+ * them in order. Returns 0 on success, otherwise non-zero and the image is
+ * left untouched. */
+int cbfs_transaction_commit(struct cbfs_transaction *txn);
+
 /* Create a new cbfs file header structure to work with.
    Returns newly allocated memory that the caller needs to free after use. */
 struct cbfs_file *cbfs_create_file_header(int type, size_t len,
@@ -66,12 +154,14 @@ int cbfs_legacy_walk(struct cbfs_image *image, cbfs_entry_callback callback,
 
 /* Primitive CBFS utilities */
 
-/* Returns a pointer to the only valid CBFS header in give buffer, otherwise
- * NULL (including when multiple headers were found). If there is a X86 ROM
- * style signature (pointer at 0xfffffffc) found in ROM, it will be selected as
- * the only header.*/
+/* Returns a pointer to the first valid CBFS header in give buffer, otherwise
+ * NULL. If there is a X86 ROM style signature (pointer at 0xfffffffc) found in
+ * ROM, it will be selected as the only header. Otherwise the start of the
+ * buffer is checked, then 4-byte aligned offsets and finally all of them.
+ * count_headers makes it scan the whole buffer and warn when it holds more
+ * than one header, which is slow on large images. */
 struct cbfs_header *cbfs_find_header(char *data, size_t size,
-				     uint32_t forced_offset);
+				     uint32_t forced_offset, bool count_headers);
 
 /* Returns the first cbfs_file entry in CBFS image by CBFS header (no matter if
  * the entry has valid content or not), otherwise NULL. */
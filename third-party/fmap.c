@@ -20,6 +20,7 @@
 #endif
 
 #include "fmap.h"
+#include "memscan.h"
 
 /* Make a best-effort assessment if the given fmap is real */
 static int is_valid_fmap(const struct fmap *fmap)
@@ -65,20 +66,23 @@ int fmap_size(const struct fmap *fmap)
 	return sizeof(*fmap) + (le16toh(fmap->nareas) * sizeof(struct fmap_area));
 }
 
-/* brute force linear search */
+/* linear search which fully validates only signature matches */
 static long int fmap_lsearch(const uint8_t *image, size_t len)
 {
-	unsigned long int offset;
-	int fmap_found = 0;
-
-	for (offset = 0; offset < len - strlen(FMAP_SIGNATURE); offset++) {
-		if (is_valid_fmap((const struct fmap *)&image[offset])) {
-			fmap_found = 1;
+	size_t offset = 0;
+	long int found;
+
+	while ((found = memscan(image + offset, len - offset, FMAP_SIGNATURE,
+				strlen(FMAP_SIGNATURE), 1)) >= 0) {
+		offset += found;
+		if (offset + sizeof(struct fmap) > len)
+			return -1;
+		if (is_valid_fmap((const struct fmap *)&image[offset]))
 			break;
-		}
+		offset++;
 	}
 
-	if (!fmap_found)
+	if (found < 0)
 		return -1;
 
 	if (offset + fmap_size((const struct fmap *)&image[offset]) > len)
@@ -151,6 +155,19 @@ long int fmap_find(const uint8_t *image, unsigned int image_len)
 	return ret;
 }
 
+int fmap_valid_at(const uint8_t *image, unsigned int image_len, long int offset)
+{
+	const struct fmap *fmap;
+
+	if (image == NULL || offset < 0 ||
+	    (unsigned long)offset + sizeof(*fmap) > image_len)
+		return 0;
+
+	fmap = (const struct fmap *)&image[offset];
+	return is_valid_fmap(fmap) &&
+		(unsigned long)offset + fmap_size(fmap) <= image_len;
+}
+
 const struct fmap_area *fmap_find_area(const struct fmap *fmap,
 							const char *name)
 {
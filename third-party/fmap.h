@@ -45,6 +45,19 @@ struct fmap {
  */
 extern long int fmap_find(const uint8_t *image, unsigned int len);
 
+/*
+ * fmap_valid_at - check whether there is an FMAP at the given offset
+ *
+ * @image:	binary image
+ * @len:	length of binary image
+ * @offset:	offset at which FMAP is expected
+ *
+ * returns 1 if an FMAP that fits in the image is found at the offset
+ * returns 0 otherwise
+ */
+extern int fmap_valid_at(const uint8_t *image, unsigned int len,
+							long int offset);
+
 /*
  * fmap_size - returns size of fmap data structure (including areas)
  *
@@ -0,0 +1,473 @@
+/* batched file I/O, through io_uring if it's enabled at build time */
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#include "io_engine.h"
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+static bool pwrite_all(int fd, const struct io_write *write)
+{
+	size_t done = 0;
+
+	while (done < write->size) {
+		ssize_t n = pwrite(fd, (const char *)write->data + done,
+				   write->size - done, write->offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ERROR("Failed to write to image file\n");
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+#ifdef USE_IO_URING
+
+/* Submission queue entries per ring, also the limit on requests in flight */
+#define RING_ENTRIES 64
+
+/* Marks completions of prefetches, whose user data is the prefetch slot */
+#define PREFETCH_TAG (1ull << 63)
+
+/* File being prefetched, closed when its last request completes */
+struct prefetch_file {
+	int fd;
+	unsigned pending;
+};
+
+/* Minimal io_uring without liburing, owned by a single thread */
+struct ring {
+	int fd;
+	unsigned entries;
+
+	void *sq_map;
+	size_t sq_map_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	void *cq_map;
+	size_t cq_map_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Requests whose completions weren't reaped yet */
+	unsigned in_flight;
+
+	/* Every prefetched file has a request in flight, so that's enough */
+	struct prefetch_file prefetches[RING_ENTRIES];
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* Threads that failed to set up a ring use the fallback from then on */
+static __thread bool ring_unavailable;
+
+static int ring_enter(struct ring *ring, unsigned to_submit,
+		      unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+			      min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+static struct io_uring_sqe *ring_get_sqe(struct ring *ring)
+{
+	const unsigned tail = *ring->sq_tail;
+	const unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	return sqe;
+}
+
+/* Publishes the entry returned by ring_get_sqe() */
+static void ring_push_sqe(struct ring *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	++ring->in_flight;
+}
+
+/* Pops a completion, returns false if there is none */
+static bool ring_pop_cqe(struct ring *ring, struct io_uring_cqe *cqe)
+{
+	const unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	*cqe = ring->cqes[head & *ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	--ring->in_flight;
+	return true;
+}
+
+/* Drops a request of a prefetched file, closing it after the last one */
+static void put_prefetch(struct prefetch_file *file)
+{
+	if (--file->pending == 0) {
+		close(file->fd);
+		file->fd = -1;
+	}
+}
+
+/* Handles completion of a prefetch, returns false for other requests */
+static bool reap_prefetch(struct ring *ring, const struct io_uring_cqe *cqe)
+{
+	if (!(cqe->user_data & PREFETCH_TAG))
+		return false;
+	put_prefetch(&ring->prefetches[cqe->user_data & ~PREFETCH_TAG]);
+	return true;
+}
+
+/* Reaps completed prefetches and waits until n more requests fit */
+static bool ring_make_room(struct ring *ring, unsigned n)
+{
+	struct io_uring_cqe cqe;
+
+	for (;;) {
+		while (ring_pop_cqe(ring, &cqe))
+			(void)reap_prefetch(ring, &cqe);
+		if (ring->in_flight + n <= ring->entries)
+			return true;
+		if (ring_enter(ring, 0, 1) < 0)
+			return false;
+	}
+}
+
+static void ring_destroy(void *arg)
+{
+	struct ring *ring = arg;
+	struct io_uring_cqe cqe;
+	unsigned i;
+
+	/* Descriptors of prefetched files are closed on completion */
+	while (ring->in_flight > 0) {
+		while (ring_pop_cqe(ring, &cqe))
+			(void)reap_prefetch(ring, &cqe);
+		if (ring->in_flight > 0 && ring_enter(ring, 0, 1) < 0)
+			break;
+	}
+
+	/* Requests that never completed after the ring has failed */
+	for (i = 0; i < RING_ENTRIES; ++i) {
+		if (ring->prefetches[i].fd >= 0)
+			close(ring->prefetches[i].fd);
+	}
+
+	munmap(ring->sqes, ring->entries * sizeof(*ring->sqes));
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static void create_ring_key(void)
+{
+	if (pthread_key_create(&ring_key, &ring_destroy) != 0)
+		ring_unavailable = true;
+}
+
+static bool ring_setup(struct ring *ring)
+{
+	struct io_uring_params params;
+	size_t sqes_size;
+	void *sqes;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd < 0)
+		return false;
+
+	ring->entries = params.sq_entries;
+	ring->sq_map_size = params.sq_off.array +
+			    params.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = params.cq_off.cqes +
+			    params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+		goto close_fd;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED)
+			goto unmap_sq;
+	}
+
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto unmap_cq;
+	ring->sqes = sqes;
+
+	ring->sq_tail = (unsigned *)((char *)ring->sq_map +
+				     params.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_map +
+				     params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_map +
+				      params.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_map +
+				     params.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_map +
+				     params.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_map +
+				     params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map +
+					     params.cq_off.cqes);
+	ring->in_flight = 0;
+	for (unsigned i = 0; i < RING_ENTRIES; ++i) {
+		ring->prefetches[i].fd = -1;
+		ring->prefetches[i].pending = 0;
+	}
+	return true;
+
+unmap_cq:
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+unmap_sq:
+	munmap(ring->sq_map, ring->sq_map_size);
+close_fd:
+	close(ring->fd);
+	return false;
+}
+
+/* Ring of the calling thread or NULL if io_uring can't be used */
+static struct ring *get_ring(void)
+{
+	struct ring *ring;
+
+	if (ring_unavailable)
+		return NULL;
+
+	pthread_once(&ring_key_once, &create_ring_key);
+	if (ring_unavailable)
+		return NULL;
+
+	ring = pthread_getspecific(ring_key);
+	if (ring)
+		return ring;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring || !ring_setup(ring)) {
+		free(ring);
+		ring_unavailable = true;
+		return NULL;
+	}
+
+	if (pthread_setspecific(ring_key, ring) != 0) {
+		ring_destroy(ring);
+		ring_unavailable = true;
+		return NULL;
+	}
+	return ring;
+}
+
+/* Submits writes in batches that fit the ring, returns false if io_uring
+ * didn't work, in which case writes that didn't complete are redone */
+static bool ring_write(struct ring *ring, int fd,
+		       const struct io_write *writes, size_t count,
+		       bool *failed)
+{
+	size_t first = 0;
+
+	while (first < count) {
+		struct io_uring_cqe cqe;
+		unsigned batch = count - first;
+		unsigned waiting;
+		unsigned i;
+
+		if (batch > ring->entries)
+			batch = ring->entries;
+		if (!ring_make_room(ring, batch))
+			return false;
+
+		for (i = 0; i < batch; ++i) {
+			const struct io_write *write = &writes[first + i];
+			struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = fd;
+			sqe->addr = (uintptr_t)write->data;
+			sqe->len = write->size;
+			sqe->off = write->offset;
+			sqe->user_data = first + i;
+			ring_push_sqe(ring);
+		}
+
+		if (ring_enter(ring, batch, batch) < 0)
+			return false;
+
+		for (waiting = batch; waiting > 0; ) {
+			if (!ring_pop_cqe(ring, &cqe)) {
+				if (ring_enter(ring, 0, 1) < 0)
+					return false;
+				continue;
+			}
+			if (reap_prefetch(ring, &cqe))
+				continue;
+			--waiting;
+
+			const struct io_write *write = &writes[cqe.user_data];
+			struct io_write rest = *write;
+
+			if (cqe.res == (int)write->size)
+				continue;
+
+			/* Old kernels lack IORING_OP_WRITE, short writes
+			 * are finished synchronously */
+			if (cqe.res > 0) {
+				rest.data = (const char *)rest.data + cqe.res;
+				rest.size -= cqe.res;
+				rest.offset += cqe.res;
+			} else if (cqe.res != -EINVAL) {
+				errno = -cqe.res;
+				ERROR("Failed to write to image file\n");
+				*failed = true;
+				continue;
+			}
+			if (!pwrite_all(fd, &rest))
+				*failed = true;
+		}
+
+		first += batch;
+	}
+	return true;
+}
+
+#endif
+
+bool io_engine_write(int fd, const struct io_write *writes, size_t count)
+{
+	size_t i;
+
+#ifdef USE_IO_URING
+	struct ring *ring = get_ring();
+	bool failed = false;
+
+	/* A single write gains nothing from being queued */
+	if (ring && count > 1) {
+		if (ring_write(ring, fd, writes, count, &failed))
+			return !failed;
+		/* Writes are idempotent, so it's safe to redo all of them */
+		ring_unavailable = true;
+	}
+#endif
+
+	for (i = 0; i < count; ++i) {
+		if (!pwrite_all(fd, &writes[i]))
+			return false;
+	}
+	return true;
+}
+
+void io_engine_prefetch(const char *path, const struct io_range *ranges,
+			size_t count)
+{
+#ifdef USE_IO_URING
+	struct ring *ring = get_ring();
+	struct prefetch_file *file = NULL;
+	size_t first;
+	unsigned i;
+
+	if (ring == NULL || count == 0)
+		return;
+
+	for (i = 0; i < RING_ENTRIES && file == NULL; ++i) {
+		if (ring->prefetches[i].pending == 0)
+			file = &ring->prefetches[i];
+	}
+	if (file == NULL)
+		return;
+
+	file->fd = open(path, O_RDONLY);
+	if (file->fd < 0)
+		return;
+
+	/* Keeps the file open while completions are reaped to make room */
+	file->pending = 1;
+
+	for (first = 0; first < count; ) {
+		unsigned batch = count - first;
+
+		if (batch > ring->entries)
+			batch = ring->entries;
+		if (!ring_make_room(ring, batch))
+			break;
+
+		for (i = 0; i < batch; ++i) {
+			const struct io_range *range = &ranges[first + i];
+			struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+			sqe->opcode = IORING_OP_FADVISE;
+			sqe->fd = file->fd;
+			sqe->off = range->offset;
+			sqe->len = range->size;
+			sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+			sqe->user_data = PREFETCH_TAG |
+					 (unsigned)(file - ring->prefetches);
+			ring_push_sqe(ring);
+			++file->pending;
+		}
+
+		if (ring_enter(ring, batch, 0) < 0) {
+			ring_unavailable = true;
+			break;
+		}
+		first += batch;
+	}
+
+	put_prefetch(file);
+#else
+	/*
+	 * A synchronous readahead right before the file is opened and mapped
+	 * only adds an open() and a close(), so there is nothing to do.
+	 */
+	(void)path;
+	(void)ranges;
+	(void)count;
+#endif
+}
@@ -0,0 +1,52 @@
+/* batched file I/O, through io_uring if it's enabled at build time */
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#ifndef IO_ENGINE_H_
+#define IO_ENGINE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** One write of a batch */
+struct io_write {
+	const void *data;
+	size_t size;
+	off_t offset;
+};
+
+/**
+ * Write all buffers of a batch to a file.
+ * With USE_IO_URING the whole batch is queued at once and the call returns
+ * when all writes complete, so their latencies overlap.  Otherwise, or if
+ * the kernel doesn't support io_uring, writes are made one by one with
+ * pwrite().
+ *
+ * @param fd     File to write to
+ * @param writes Buffers and their offsets in the file
+ * @param count  Number of writes
+ * @return       Whether everything was written
+ */
+bool io_engine_write(int fd, const struct io_write *writes, size_t count);
+
+/** Part of a file to read ahead */
+struct io_range {
+	off_t offset;
+	size_t size;
+};
+
+/**
+ * Start reading parts of a file into the page cache without waiting for it,
+ * so that they are there when the file is opened and mapped later.  Failures
+ * are ignored.  Requests of many files can be in flight from a single thread.
+ * Does nothing without USE_IO_URING or when the thread has no ring, because
+ * only an asynchronous request can overlap with work on other images.
+ *
+ * @param path   File that will be needed soon
+ * @param ranges Parts of the file that will be read
+ * @param count  Number of ranges
+ */
+void io_engine_prefetch(const char *path, const struct io_range *ranges,
+			size_t count);
+
+#endif
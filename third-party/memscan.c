@@ -0,0 +1,178 @@
+/* vectorized search for signatures in binary images */
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#include "memscan.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEMSCAN_X86 1
+#endif
+
+typedef long (*memscan_fn)(const uint8_t *data, size_t size,
+		const uint8_t *signature, size_t sig_len, size_t stride);
+
+static long memscan_scalar(const uint8_t *data, size_t size,
+		const uint8_t *signature, size_t sig_len, size_t stride)
+{
+	size_t offset;
+
+	if (stride == 1) {
+		const uint8_t *p = data;
+		const uint8_t *end = data + size - sig_len + 1;
+
+		while ((p = memchr(p, signature[0], end - p)) != NULL) {
+			if (memcmp(p, signature, sig_len) == 0)
+				return p - data;
+			++p;
+		}
+		return -1;
+	}
+
+	for (offset = 0; offset + sig_len <= size; offset += stride) {
+		if (data[offset] == signature[0] &&
+				memcmp(data + offset, signature, sig_len) == 0)
+			return offset;
+	}
+	return -1;
+}
+
+/* Bits of a match mask that correspond to offsets which are multiples of
+ * stride, assuming the block starts at such an offset. */
+static uint32_t stride_mask(size_t stride)
+{
+	switch (stride) {
+	case 1:
+		return 0xffffffff;
+	case 2:
+		return 0x55555555;
+	case 4:
+		return 0x11111111;
+	case 8:
+		return 0x01010101;
+	case 16:
+		return 0x00010001;
+	default:
+		return 0x00000001;
+	}
+}
+
+/* Checks candidates from the mask, returns offset of a match or -1 */
+static long check_candidates(const uint8_t *data, size_t block,
+		uint32_t mask, const uint8_t *signature, size_t sig_len)
+{
+	while (mask != 0) {
+		const size_t offset = block + __builtin_ctz(mask);
+		if (memcmp(data + offset + 1, signature + 1, sig_len - 1) == 0)
+			return offset;
+		mask &= mask - 1;
+	}
+	return -1;
+}
+
+#ifdef MEMSCAN_X86
+
+__attribute__((target("sse2")))
+static long memscan_sse2(const uint8_t *data, size_t size,
+		const uint8_t *signature, size_t sig_len, size_t stride)
+{
+	const __m128i first = _mm_set1_epi8(signature[0]);
+	const __m128i last = _mm_set1_epi8(signature[sig_len - 1]);
+	const uint32_t allowed = stride_mask(stride) & 0xffff;
+	size_t block;
+
+	for (block = 0; block + 16 + sig_len - 1 <= size; block += 16) {
+		const __m128i head = _mm_loadu_si128(
+					(const __m128i *)(data + block));
+		const __m128i tail = _mm_loadu_si128(
+				(const __m128i *)(data + block + sig_len - 1));
+		const uint32_t mask = allowed & _mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(head, first),
+				      _mm_cmpeq_epi8(tail, last)));
+		if (mask != 0) {
+			long offset = check_candidates(data, block, mask,
+							signature, sig_len);
+			if (offset >= 0)
+				return offset;
+		}
+	}
+
+	long offset = memscan_scalar(data + block, size - block, signature,
+							sig_len, stride);
+	return offset < 0 ? -1 : (long)block + offset;
+}
+
+__attribute__((target("avx2")))
+static long memscan_avx2(const uint8_t *data, size_t size,
+		const uint8_t *signature, size_t sig_len, size_t stride)
+{
+	const __m256i first = _mm256_set1_epi8(signature[0]);
+	const __m256i last = _mm256_set1_epi8(signature[sig_len - 1]);
+	const uint32_t allowed = stride_mask(stride);
+	size_t block;
+
+	for (block = 0; block + 32 + sig_len - 1 <= size; block += 32) {
+		const __m256i head = _mm256_loadu_si256(
+					(const __m256i *)(data + block));
+		const __m256i tail = _mm256_loadu_si256(
+				(const __m256i *)(data + block + sig_len - 1));
+		const uint32_t mask = allowed & (uint32_t)_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+					 _mm256_cmpeq_epi8(tail, last)));
+		if (mask != 0) {
+			long offset = check_candidates(data, block, mask,
+							signature, sig_len);
+			if (offset >= 0)
+				return offset;
+		}
+	}
+
+	long offset = memscan_scalar(data + block, size - block, signature,
+							sig_len, stride);
+	return offset < 0 ? -1 : (long)block + offset;
+}
+
+#endif
+
+static memscan_fn select_memscan(void)
+{
+#ifdef MEMSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return memscan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return memscan_sse2;
+#endif
+	return memscan_scalar;
+}
+
+long memscan(const void *data, size_t size, const void *signature,
+					size_t sig_len, size_t stride)
+{
+	static memscan_fn selected;
+	memscan_fn impl;
+
+	assert(data);
+	assert(signature);
+	assert(sig_len > 0);
+	assert(stride > 0 && (stride & (stride - 1)) == 0);
+
+	if (size < sig_len)
+		return -1;
+
+	/* Vector masks cover strides up to 16 */
+	if (stride > 16)
+		return memscan_scalar(data, size, signature, sig_len, stride);
+
+	/* Racing threads would store the same value */
+	impl = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+	if (!impl) {
+		impl = select_memscan();
+		__atomic_store_n(&selected, impl, __ATOMIC_RELAXED);
+	}
+
+	return impl(data, size, signature, sig_len, stride);
+}
@@ -0,0 +1,24 @@
+/* vectorized search for signatures in binary images */
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#ifndef MEMSCAN_H_
+#define MEMSCAN_H_
+
+#include <stddef.h>
+
+/**
+ * Find the first occurrence of a signature at an offset that is a multiple of
+ * stride.  SSE2 or AVX2 are used when the CPU supports them, only candidates
+ * whose first and last bytes match are compared in full.
+ *
+ * @param data       Data to search through
+ * @param size       Size of the data
+ * @param signature  Bytes to look for
+ * @param sig_len    Length of the signature, must be non-zero
+ * @param stride     Alignment of matches relative to data, a power of two
+ * @return           Offset of the match or -1 if there is none
+ */
+long memscan(const void *data, size_t size, const void *signature,
+					size_t sig_len, size_t stride);
+
+#endif
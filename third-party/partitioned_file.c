@@ -2,45 +2,207 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 
 #define __BSD_VISIBLE 1
+#define _GNU_SOURCE
 
 #include "partitioned_file.h"
 
 #include "cbfs_sections.h"
+#include "io_engine.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/fs.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Granularity at which modified bytes are looked for and written back */
+#define COMMIT_CHUNK_SIZE 64
+
+/* Byte range of the file that awaits partitioned_file_commit() */
+struct dirty_range {
+	size_t offset;
+	size_t size;
+};
 
 struct partitioned_file {
 	struct fmap *fmap;
+	/* Whether fmap was loaded from a separate file and is allocated. */
+	bool own_fmap;
 	struct buffer buffer;
-	FILE *stream;
+	int fd;
+	/* Whether buffer is a private mapping of the file rather than a copy. */
+	bool mapped;
+	/* Read-only shared mapping that reflects what is currently on disk,
+	 * NULL if the file isn't mapped. */
+	const char *on_disk;
+	/* Sorted, non-overlapping and non-adjacent ranges */
+	struct dirty_range *dirty;
+	size_t dirty_count;
+	/* Whether commits replace the file instead of writing into it. */
+	bool atomic;
+	/* Where the next commit writes a modified copy of the file, the copy
+	 * becomes the file afterwards.  NULL to write into the file. */
+	char *output_file;
+	/* Whether the file was read from stdin and commits go to stdout. */
+	bool stream;
 };
 
+/* Maps the whole file copy-on-write, so that changes made through buffers
+ * stay in memory until partitioned_file_commit() writes them through.
+ * Returns false if the file can't be mapped, e.g. when it's not a regular
+ * file. */
+static bool map_flat_file(struct partitioned_file *file, const char *filename,
+								bool lazy)
+{
+	struct stat st;
+	void *data;
+
+	if (fstat(file->fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return false;
+
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		    file->fd, 0);
+	if (data == MAP_FAILED)
+		return false;
+
+	/* Pages are read in only when touched, turning off read-ahead limits
+	 * reads to pages of FMAP, regions and CBFS entries actually used */
+	if (lazy)
+		(void)madvise(data, st.st_size, MADV_RANDOM);
+
+	buffer_init(&file->buffer, strdup(filename), data, st.st_size);
+	file->mapped = true;
+
+	/* Doesn't take extra memory, pages are shared with the page cache */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+	if (data != MAP_FAILED) {
+		if (lazy)
+			(void)madvise(data, st.st_size, MADV_RANDOM);
+		file->on_disk = data;
+	}
+
+	return true;
+}
+
+/* Opens and locks the file.  Atomic commits rename a new file over the old
+ * one, so if that happened while waiting for the lock, the lock is taken on
+ * the new file instead. */
+static int open_locked(const char *filename, bool write_access)
+{
+	for (;;) {
+		struct stat fd_st;
+		struct stat path_st;
+		int fd = open(filename, write_access ? O_RDWR : O_RDONLY);
+
+		if (fd == -1)
+			return -1;
+		if (flock(fd, LOCK_EX)) {
+			int saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+
+		if (fstat(fd, &fd_st) || stat(filename, &path_st) ||
+		    (fd_st.st_dev == path_st.st_dev &&
+		     fd_st.st_ino == path_st.st_ino))
+			return fd;
+
+		close(fd);
+	}
+}
+
+/* Reads the whole image from stdin, pipes can't be mapped or locked */
+static bool read_stream(struct partitioned_file *file)
+{
+	char *data = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+
+	for (;;) {
+		if (size == capacity) {
+			capacity = capacity ? 2 * capacity : 1024 * 1024;
+			char *grown = realloc(data, capacity);
+			if (!grown) {
+				ERROR("Failed to allocate image buffer\n");
+				free(data);
+				return false;
+			}
+			data = grown;
+		}
+
+		ssize_t n = read(STDIN_FILENO, data + size, capacity - size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("stdin");
+			free(data);
+			return false;
+		}
+		if (n == 0)
+			break;
+		size += n;
+	}
+
+	if (size == 0) {
+		ERROR("No image on stdin\n");
+		free(data);
+		return false;
+	}
+
+	buffer_init(&file->buffer, strdup("stdin"), data, size);
+	return true;
+}
+
 static partitioned_file_t *reopen_flat_file(const char *filename,
-					    bool write_access)
+				const struct partitioned_file_params *params)
 {
 	assert(filename);
 	struct partitioned_file *file = calloc(1, sizeof(*file));
-	const char *access_mode;
 
 	if (!file) {
 		ERROR("Failed to allocate partitioned file structure\n");
 		return NULL;
 	}
 
-	if (buffer_from_file(&file->buffer, filename)) {
-		free(file);
+	if (strcmp(filename, PARTITIONED_FILE_STDIO) == 0) {
+		file->fd = -1;
+		file->stream = true;
+		if (!read_stream(file)) {
+			partitioned_file_close(file);
+			return NULL;
+		}
+		return file;
+	}
+
+	/* Lock before reading, so the contents can't change under us */
+	file->fd = open_locked(filename, params->write_access);
+	if (file->fd == -1) {
+		perror(filename);
+		partitioned_file_close(file);
 		return NULL;
 	}
+	file->atomic = params->atomic;
 
-	access_mode = write_access ?  "rb+" : "rb";
-	file->stream = fopen(filename, access_mode);
+	if (params->output_file) {
+		file->output_file = strdup(params->output_file);
+		if (!file->output_file) {
+			ERROR("Failed to allocate output path\n");
+			partitioned_file_close(file);
+			return NULL;
+		}
+	}
 
-	if (!file->stream || flock(fileno(file->stream), LOCK_EX)) {
-		perror(filename);
+	if (!map_flat_file(file, filename, params->lazy) &&
+	    buffer_from_file(&file->buffer, filename)) {
 		partitioned_file_close(file);
 		return NULL;
 	}
@@ -48,17 +210,111 @@ static partitioned_file_t *reopen_flat_file(const char *filename,
 	return file;
 }
 
+/* Whether a valid FMAP whose FMAP section points back to it is at offset */
+static bool fmap_hint_valid(const struct buffer *buffer, long offset)
+{
+	const struct fmap *fmap;
+	const struct fmap_area *fmap_fmap_entry;
+
+	if (!fmap_valid_at((const uint8_t *)buffer->data, buffer->size, offset))
+		return false;
+
+	fmap = (const struct fmap *)(buffer->data + offset);
+	fmap_fmap_entry = fmap_find_area(fmap, SECTION_NAME_FMAP);
+	return fmap_fmap_entry && (long)fmap_fmap_entry->offset == offset;
+}
+
 partitioned_file_t *partitioned_file_reopen(const char *filename,
 					    bool write_access)
+{
+	const struct partitioned_file_params params = {
+		.write_access = write_access,
+		.fmap_offset = -1,
+		.lazy = false,
+		.fmap_file = NULL,
+		.partial = false,
+		.atomic = false,
+		.output_file = NULL,
+	};
+
+	return partitioned_file_open(filename, &params);
+}
+
+/* Loads FMAP from a file that holds just it or a whole image */
+static struct fmap *read_fmap_file(const char *fmap_file)
+{
+	struct buffer buffer;
+	struct fmap *fmap = NULL;
+	long offset;
+	int size;
+
+	if (buffer_from_file(&buffer, fmap_file))
+		return NULL;
+
+	offset = fmap_find((const uint8_t *)buffer.data, buffer.size);
+	if (offset < 0) {
+		ERROR("No FMAP found in '%s'\n", fmap_file);
+		goto out;
+	}
+
+	size = fmap_size((const struct fmap *)(buffer.data + offset));
+	if ((size_t)offset + size > buffer.size) {
+		ERROR("FMAP in '%s' is truncated\n", fmap_file);
+		goto out;
+	}
+
+	fmap = malloc(size);
+	if (!fmap) {
+		ERROR("Failed to allocate FMAP\n");
+		goto out;
+	}
+	memcpy(fmap, buffer.data + offset, size);
+
+out:
+	buffer_delete(&buffer);
+	return fmap;
+}
+
+partitioned_file_t *partitioned_file_open(const char *filename,
+				const struct partitioned_file_params *params)
 {
 	assert(filename);
+	assert(params);
 
-	partitioned_file_t *file = reopen_flat_file(filename, write_access);
+	partitioned_file_t *file = reopen_flat_file(filename, params);
 	if (!file)
 		return NULL;
 
-	long fmap_region_offset = fmap_find((const uint8_t *)file->buffer.data,
-							file->buffer.size);
+	if (params->fmap_file) {
+		file->fmap = read_fmap_file(params->fmap_file);
+		if (!file->fmap) {
+			partitioned_file_close(file);
+			return NULL;
+		}
+		file->own_fmap = true;
+
+		if (!params->partial && file->fmap->size > file->buffer.size) {
+			ERROR("FMAP records image size as %u, but file is only %zu bytes\n",
+					file->fmap->size, file->buffer.size);
+			partitioned_file_close(file);
+			return NULL;
+		}
+		/* There is no FMAP section in the file to point back to it */
+		return file;
+	}
+
+	long fmap_region_offset = -1;
+	if (params->fmap_offset >= 0) {
+		if (fmap_hint_valid(&file->buffer, params->fmap_offset))
+			fmap_region_offset = params->fmap_offset;
+		else
+			WARN("No FMAP at offset 0x%lx, searching the image\n",
+							params->fmap_offset);
+	}
+	if (fmap_region_offset < 0)
+		fmap_region_offset = fmap_find(
+					(const uint8_t *)file->buffer.data,
+					file->buffer.size);
 	if (fmap_region_offset < 0) {
 		/* Supporting partitioned files only */
 		partitioned_file_close(file);
@@ -66,7 +322,7 @@ partitioned_file_t *partitioned_file_reopen(const char *filename,
 	}
 	file->fmap = (struct fmap *)(file->buffer.data + fmap_region_offset);
 
-	if (file->fmap->size > file->buffer.size) {
+	if (!params->partial && file->fmap->size > file->buffer.size) {
 		int fmap_region_size = fmap_size(file->fmap);
 		ERROR("FMAP records image size as %u, but file is only %zu bytes%s\n",
 					file->fmap->size, file->buffer.size,
@@ -100,7 +356,7 @@ bool partitioned_file_write_region(partitioned_file_t *file,
 						const struct buffer *buffer)
 {
 	assert(file);
-	assert(file->stream);
+	assert(file->fd != -1 || file->stream);
 	assert(buffer);
 	assert(buffer->data);
 
@@ -112,18 +368,438 @@ bool partitioned_file_write_region(partitioned_file_t *file,
 		ERROR("Attempted to write data off the end of image file\n");
 		return false;
 	}
+	if (buffer->size == 0)
+		return true;
 
-	if (fseek(file->stream, buffer->offset, SEEK_SET)) {
-		ERROR("Failed to seek within image file\n");
-		return false;
+	size_t start = buffer->offset;
+	size_t end = buffer->offset + buffer->size;
+	size_t i = 0;
+
+	/* Skip ranges which end before the new one */
+	while (i < file->dirty_count &&
+			file->dirty[i].offset + file->dirty[i].size < start)
+		++i;
+
+	/* Absorb ranges which overlap with or touch the new one */
+	size_t first = i;
+	while (i < file->dirty_count && file->dirty[i].offset <= end) {
+		const struct dirty_range *range = &file->dirty[i];
+		if (range->offset < start)
+			start = range->offset;
+		if (range->offset + range->size > end)
+			end = range->offset + range->size;
+		++i;
 	}
-	if (!fwrite(buffer->data, buffer->size, 1, file->stream)) {
-		ERROR("Failed to write to image file\n");
+
+	if (first == i) {
+		struct dirty_range *ranges = realloc(file->dirty,
+				(file->dirty_count + 1) * sizeof(*ranges));
+		if (!ranges) {
+			ERROR("Failed to allocate dirty range\n");
+			return false;
+		}
+		file->dirty = ranges;
+		memmove(&ranges[first + 1], &ranges[first],
+			(file->dirty_count - first) * sizeof(*ranges));
+		++file->dirty_count;
+	} else {
+		memmove(&file->dirty[first + 1], &file->dirty[i],
+			(file->dirty_count - i) * sizeof(*file->dirty));
+		file->dirty_count -= i - first - 1;
+	}
+
+	file->dirty[first].offset = start;
+	file->dirty[first].size = end - start;
+	return true;
+}
+
+/* Writes collected from dirty ranges to be issued together */
+struct write_batch {
+	struct io_write *writes;
+	size_t count;
+	size_t capacity;
+};
+
+static bool write_range(struct partitioned_file *file,
+			struct write_batch *batch, size_t offset, size_t size)
+{
+	if (batch->count == batch->capacity) {
+		size_t capacity = batch->capacity ? 2 * batch->capacity : 16;
+		struct io_write *writes = realloc(batch->writes,
+						  capacity * sizeof(*writes));
+		if (!writes) {
+			ERROR("Failed to allocate write batch\n");
+			return false;
+		}
+		batch->writes = writes;
+		batch->capacity = capacity;
+	}
+
+	batch->writes[batch->count++] = (struct io_write){
+		.data = file->buffer.data + offset,
+		.size = size,
+		.offset = offset,
+	};
+	return true;
+}
+
+static bool chunk_changed(const struct partitioned_file *file, size_t offset,
+								size_t end)
+{
+	size_t size = end - offset;
+	if (size > COMMIT_CHUNK_SIZE)
+		size = COMMIT_CHUNK_SIZE;
+	return memcmp(file->buffer.data + offset, file->on_disk + offset,
+								size) != 0;
+}
+
+/* Queues only those chunks of the range that differ from file's contents */
+static bool write_changes(struct partitioned_file *file,
+			  struct write_batch *batch,
+			  const struct dirty_range *range)
+{
+	size_t offset = range->offset;
+	const size_t end = range->offset + range->size;
+
+	if (!file->on_disk)
+		return write_range(file, batch, range->offset, range->size);
+
+	while (offset < end) {
+		while (offset < end && !chunk_changed(file, offset, end))
+			offset += COMMIT_CHUNK_SIZE;
+		if (offset >= end)
+			break;
+
+		size_t start = offset;
+		while (offset < end && chunk_changed(file, offset, end))
+			offset += COMMIT_CHUNK_SIZE;
+		if (offset > end)
+			offset = end;
+
+		if (!write_range(file, batch, start, offset - start))
+			return false;
+	}
+	return true;
+}
+
+/* Makes dst a copy of the file, sharing its extents if the filesystem can */
+static bool clone_file(const struct partitioned_file *file, int dst)
+{
+	const size_t size = file->buffer.size;
+	loff_t in = 0;
+	loff_t out = 0;
+
+	if (ioctl(dst, FICLONE, file->fd) == 0)
+		return true;
+
+	/* Copies in the kernel, might still share extents or offload */
+	while ((size_t)in < size) {
+		ssize_t n = copy_file_range(file->fd, &in, dst, &out,
+					    size - in, 0);
+		if (n <= 0)
+			break;
+	}
+	if ((size_t)in == size)
+		return true;
+
+	struct io_write rest = {
+		.data = file->on_disk + in,
+		.size = size - in,
+		.offset = in,
+	};
+	return io_engine_write(dst, &rest, 1);
+}
+
+/* Creates a file in dir which disappears if it's never linked, falling back
+ * to a named file.  *tmp_name is NULL in the first case. */
+static int create_temp(const char *target, const char *dir, mode_t mode,
+		       char **tmp_name)
+{
+	int fd;
+
+	*tmp_name = NULL;
+
+	fd = open(dir, O_TMPFILE | O_RDWR, mode);
+	if (fd != -1)
+		return fd;
+
+	*tmp_name = malloc(strlen(target) + sizeof(".XXXXXX"));
+	if (!*tmp_name)
+		return -1;
+	sprintf(*tmp_name, "%s.XXXXXX", target);
+
+	fd = mkstemp(*tmp_name);
+	if (fd == -1) {
+		free(*tmp_name);
+		*tmp_name = NULL;
+	}
+	return fd;
+}
+
+/* Gives an anonymous temporary file a unique name next to target */
+static char *link_temp(int fd, const char *target)
+{
+	char proc_path[64];
+	char *name = malloc(strlen(target) + 32);
+
+	if (!name)
+		return NULL;
+
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	for (unsigned attempt = 0; attempt < 100; ++attempt) {
+		sprintf(name, "%s.%ld.%u", target, (long)getpid(), attempt);
+		if (linkat(AT_FDCWD, proc_path, AT_FDCWD, name,
+			   AT_SYMLINK_FOLLOW) == 0)
+			return name;
+		if (errno != EEXIST)
+			break;
+	}
+
+	free(name);
+	return NULL;
+}
+
+static void sync_dir(const char *dir)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+	if (fd != -1) {
+		(void)fsync(fd);
+		close(fd);
+	}
+}
+
+/* Writes a copy of the file with the batch applied next to target, syncs it
+ * and renames it over target.  Returns locked descriptor of the new file or
+ * -1 on error, target is left intact on error. */
+static int write_copy(const struct partitioned_file *file,
+		      const struct write_batch *batch, const char *target)
+{
+	struct stat st;
+	char *dir_path;
+	char *tmp_name = NULL;
+	int fd = -1;
+
+	if (!file->on_disk || fstat(file->fd, &st)) {
+		ERROR("Only mapped regular files can be replaced atomically\n");
+		return -1;
+	}
+
+	dir_path = strdup(target);
+	if (!dir_path) {
+		ERROR("Failed to allocate path\n");
+		return -1;
+	}
+	const char *dir = dirname(dir_path);
+
+	fd = create_temp(target, dir, st.st_mode & 07777, &tmp_name);
+	if (fd == -1) {
+		perror(dir);
+		goto failure;
+	}
+
+	if (fchmod(fd, st.st_mode & 07777)) {
+		perror(target);
+		goto failure;
+	}
+	/* Keeping the owner takes privileges, the copy is fine without it */
+	(void)!fchown(fd, st.st_uid, st.st_gid);
+
+	if (!clone_file(file, fd) ||
+	    !io_engine_write(fd, batch->writes, batch->count)) {
+		ERROR("Failed to write a copy of the image\n");
+		goto failure;
+	}
+
+	/* Lock before the file becomes visible under the target's name */
+	if (fsync(fd) || flock(fd, LOCK_EX)) {
+		perror(target);
+		goto failure;
+	}
+
+	if (!tmp_name) {
+		tmp_name = link_temp(fd, target);
+		if (!tmp_name) {
+			perror(target);
+			goto failure;
+		}
+	}
+
+	if (rename(tmp_name, target)) {
+		perror(target);
+		goto failure;
+	}
+
+	sync_dir(dir);
+	free(tmp_name);
+	free(dir_path);
+	return fd;
+
+failure:
+	if (tmp_name)
+		unlink(tmp_name);
+	if (fd != -1)
+		close(fd);
+	free(tmp_name);
+	free(dir_path);
+	return -1;
+}
+
+/* Makes the file refer to its copy from now on */
+static void switch_to_copy(struct partitioned_file *file, int fd)
+{
+	flock(file->fd, LOCK_UN);
+	close(file->fd);
+	file->fd = fd;
+
+	/* Further commits compare against the new contents */
+	munmap((void *)file->on_disk, file->buffer.size);
+	file->on_disk = mmap(NULL, file->buffer.size, PROT_READ, MAP_SHARED,
+			     fd, 0);
+	if (file->on_disk == MAP_FAILED)
+		file->on_disk = NULL;
+}
+
+/* Replaces the file with its modified copy and switches to the copy */
+static bool replace_file(struct partitioned_file *file,
+			 const struct write_batch *batch)
+{
+	int fd;
+
+	/* The file stays as it is if nothing has changed */
+	if (batch->count == 0)
+		return true;
+
+	fd = write_copy(file, batch, file->buffer.name);
+	if (fd == -1)
+		return false;
+
+	switch_to_copy(file, fd);
+	return true;
+}
+
+/* Writes modified copy of the file to the output path and switches to it */
+static bool write_output(struct partitioned_file *file,
+			 const struct write_batch *batch)
+{
+	int fd = write_copy(file, batch, file->output_file);
+	if (fd == -1)
 		return false;
+
+	switch_to_copy(file, fd);
+	free(file->buffer.name);
+	file->buffer.name = file->output_file;
+	file->output_file = NULL;
+	return true;
+}
+
+/* Emits the whole image, a pipe can only be written sequentially */
+static bool write_stream(const struct partitioned_file *file)
+{
+	size_t done = 0;
+
+	while (done < file->buffer.size) {
+		ssize_t n = write(STDOUT_FILENO, file->buffer.data + done,
+				  file->buffer.size - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("stdout");
+			return false;
+		}
+		done += n;
 	}
 	return true;
 }
 
+bool partitioned_file_commit(partitioned_file_t *file)
+{
+	assert(file);
+	assert(file->fd != -1 || file->stream);
+
+	struct write_batch batch = { NULL, 0, 0 };
+	bool success = true;
+
+	for (size_t i = 0; i < file->dirty_count && success; ++i)
+		success = write_changes(file, &batch, &file->dirty[i]);
+
+	/* All changed chunks are in flight at once if the engine allows */
+	if (success && file->stream)
+		success = write_stream(file);
+	else if (success && file->output_file)
+		success = write_output(file, &batch);
+	else if (success && file->atomic)
+		success = replace_file(file, &batch);
+	else if (success)
+		success = io_engine_write(file->fd, batch.writes, batch.count);
+
+	free(batch.writes);
+	if (!success)
+		return false;
+
+	free(file->dirty);
+	file->dirty = NULL;
+	file->dirty_count = 0;
+	return true;
+}
+
+/* Whether a dirty range modifies bytes within [offset, end) */
+static bool range_changed(const struct partitioned_file *file,
+		const struct dirty_range *range, size_t offset, size_t end)
+{
+	if (offset < range->offset)
+		offset = range->offset;
+	if (end > range->offset + range->size)
+		end = range->offset + range->size;
+	if (offset >= end)
+		return false;
+	if (!file->on_disk)
+		return true;
+	return memcmp(file->buffer.data + offset, file->on_disk + offset,
+							end - offset) != 0;
+}
+
+long partitioned_file_changed_blocks(const partitioned_file_t *file,
+				size_t block_size, size_t **offsets)
+{
+	assert(file);
+	assert(block_size);
+	assert(offsets);
+
+	size_t *blocks = NULL;
+	long count = 0;
+
+	*offsets = NULL;
+
+	for (size_t i = 0; i < file->dirty_count; ++i) {
+		const struct dirty_range *range = &file->dirty[i];
+		size_t block = range->offset - range->offset % block_size;
+
+		for (; block < range->offset + range->size;
+							block += block_size) {
+			/* Ranges never share a byte, but can share a block */
+			if (count > 0 && blocks[count - 1] == block)
+				continue;
+			if (!range_changed(file, range, block,
+							block + block_size))
+				continue;
+
+			size_t *grown = realloc(blocks,
+						(count + 1) * sizeof(*blocks));
+			if (!grown) {
+				ERROR("Failed to allocate block list\n");
+				free(blocks);
+				return -1;
+			}
+			blocks = grown;
+			blocks[count++] = block;
+		}
+	}
+
+	*offsets = blocks;
+	return count;
+}
+
 bool partitioned_file_read_region(struct buffer *dest,
 			const partitioned_file_t *file, const char *region)
 {
@@ -156,17 +832,45 @@ bool partitioned_file_read_region(struct buffer *dest,
 	return true;
 }
 
+const struct fmap *partitioned_file_get_fmap(const partitioned_file_t *file)
+{
+	assert(file);
+	return file->fmap;
+}
+
+long partitioned_file_fmap_offset(const partitioned_file_t *file)
+{
+	assert(file);
+	assert(file->fmap);
+	if (file->own_fmap)
+		return -1;
+	return (const char *)file->fmap - file->buffer.data;
+}
+
 void partitioned_file_close(partitioned_file_t *file)
 {
 	if (!file)
 		return;
 
+	if (file->own_fmap)
+		free(file->fmap);
 	file->fmap = NULL;
-	buffer_delete(&file->buffer);
-	if (file->stream) {
-		flock(fileno(file->stream), LOCK_UN);
-		fclose(file->stream);
-		file->stream = NULL;
+	if (file->mapped) {
+		munmap(file->buffer.data, file->buffer.size);
+		if (file->on_disk)
+			munmap((void *)file->on_disk, file->buffer.size);
+		file->on_disk = NULL;
+		free(file->buffer.name);
+		file->mapped = false;
+	} else {
+		buffer_delete(&file->buffer);
+	}
+	free(file->dirty);
+	free(file->output_file);
+	if (file->fd != -1) {
+		flock(file->fd, LOCK_UN);
+		close(file->fd);
+		file->fd = -1;
 	}
 	free(file);
 }
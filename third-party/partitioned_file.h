@@ -12,10 +12,19 @@
 
 typedef struct partitioned_file partitioned_file_t;
 
+/* File name which stands for reading the image from stdin and writing it to
+ * stdout */
+#define PARTITIONED_FILE_STDIO "-"
+
 /**
  * Read a file back in from the disk.
- * An in-memory buffer is created and populated with the file's
- * contents. If the image contains an FMAP, it will be opened as a
+ * The file is mapped into memory copy-on-write, so no copy of the image is
+ * made and modifications of the buffer don't reach the file until they are
+ * written back.  Files that can't be mapped are read into an in-memory buffer
+ * instead.  The file stays locked until it's closed.  PARTITIONED_FILE_STDIO
+ * reads the image from stdin without locking it, in which case every commit
+ * writes the whole image to stdout.  If the image contains an
+ * FMAP, it will be opened as a
  * full partitioned file; otherwise, it will be opened as a flat file as
  * if it had been created by partitioned_file_create_flat().
  * The partitioned_file_t returned from this function is separately owned by the
@@ -28,12 +37,51 @@ typedef struct partitioned_file partitioned_file_t;
 partitioned_file_t *partitioned_file_reopen(const char *filename,
 					    bool write_access);
 
+/** Parameters of partitioned_file_open() */
+struct partitioned_file_params {
+	/* True if the file needs to be modified */
+	bool write_access;
+	/* Expected offset of FMAP or negative if unknown, the image is
+	 * searched if FMAP isn't found there */
+	long fmap_offset;
+	/* Read only the pages that are accessed, without read-ahead.  Pays off
+	 * when only FMAP and a few small regions are needed, particularly with
+	 * fmap_offset set, so that FMAP isn't searched for. */
+	bool lazy;
+	/* File to take FMAP from instead of the image, e.g. FMAP region read
+	 * separately from the flash, or NULL */
+	const char *fmap_file;
+	/* Don't require the image to hold everything FMAP describes, accessing
+	 * regions that aren't in the file fails instead */
+	bool partial;
+	/* Commit by writing a modified copy of the file and renaming it over
+	 * the original, so that a crash leaves either the old or the new
+	 * contents.  The copy is a reflink where the filesystem supports it. */
+	bool atomic;
+	/* Write the modified file to this path instead, the same way atomic
+	 * commits write a copy, or NULL.  The input is only read, and the
+	 * output is what subsequent commits modify. */
+	const char *output_file;
+};
+
+/**
+ * Same as partitioned_file_reopen(), but with extra parameters.
+ *
+ * @param filename Name of the file to read in
+ * @param params   How to open the file
+ * @return         Caller-owned partitioned file, or NULL on error
+ */
+partitioned_file_t *partitioned_file_open(const char *filename,
+				const struct partitioned_file_params *params);
+
 /**
- * Write a buffer's contents to its original region within a segmented file.
+ * Schedule a buffer's contents to be written to its original region within a
+ * segmented file.
  * This function should only be called on buffers originally retrieved by a call
  * to partitioned_file_read_region() on the same partitioned file object. The
- * contents of this buffer are copied back to the same region of the buffer and
- * backing file that the region occupied before.
+ * range the buffer occupies is only marked as dirty, nothing reaches the
+ * backing file until partitioned_file_commit() is called.  Overlapping and
+ * adjacent ranges are coalesced.
  *
  * @param file   Partitioned file to which to write the data
  * @param buffer Modified buffer obtained from partitioned_file_read_region()
@@ -42,6 +90,32 @@ partitioned_file_t *partitioned_file_reopen(const char *filename,
 bool partitioned_file_write_region(partitioned_file_t *file,
 						const struct buffer *buffer);
 
+/**
+ * Write all dirty ranges to the backing file at once.
+ * When the file is mapped, only the parts of the ranges that differ from the
+ * file's current contents are actually written.  All writes are handed to
+ * io_engine_write() as a single batch.  With atomic commits, the writes go to
+ * a copy of the file which then replaces it.
+ *
+ * @param file Partitioned file to flush
+ * @return     Whether the operation was successful
+ */
+bool partitioned_file_commit(partitioned_file_t *file);
+
+/**
+ * List erase blocks that partitioned_file_commit() would change.
+ * Only dirty ranges are examined.  When the file isn't mapped and its original
+ * contents aren't at hand, every block overlapping a dirty range is listed.
+ *
+ * @param file       Partitioned file with pending changes
+ * @param block_size Size of an erase block
+ * @param offsets    Set to caller-owned array of block offsets in ascending
+ *                   order, NULL if there are none
+ * @return           Number of blocks, or -1 on error
+ */
+long partitioned_file_changed_blocks(const partitioned_file_t *file,
+				size_t block_size, size_t **offsets);
+
 /**
  * Obtain one particular region of a segmented file.
  * The result is owned by the partitioned_file_t and shared among every caller
@@ -52,7 +126,7 @@ bool partitioned_file_write_region(partitioned_file_t *file,
  * will be reflected in any buffers handed out---whether earlier or later---for
  * any region inclusive of the altered location(s). However, the backing file
  * will not be updated until someone calls partitioned_file_write_region() on a
- * buffer that includes the alterations.
+ * buffer that includes the alterations and then partitioned_file_commit().
  *
  * @param dest   Empty destination buffer for the data
  * @param file   Partitioned file from which to read the data
@@ -62,7 +136,13 @@ bool partitioned_file_write_region(partitioned_file_t *file,
 bool partitioned_file_read_region(struct buffer *dest,
 			const partitioned_file_t *file, const char *region);
 
-/** @param file Partitioned file to flush and cleanup */
+/** @return FMAP of the file */
+const struct fmap *partitioned_file_get_fmap(const partitioned_file_t *file);
+
+/** @return Offset of FMAP within the file or -1 if it came from elsewhere */
+long partitioned_file_fmap_offset(const partitioned_file_t *file);
+
+/** @param file Partitioned file to cleanup, uncommitted changes are dropped */
 void partitioned_file_close(partitioned_file_t *file);
 
 /** @return Whether to include area in the running count. */